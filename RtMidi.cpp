@@ -38,7 +38,24 @@
 /**********************************************************************/
 
 #include "RtMidi.h"
+#include <algorithm>
+#include <chrono>
 #include <sstream>
+#include <thread>
+
+// Diagnostics go to std::cerr.  Define RTMIDI_LOG_WARN / RTMIDI_LOG_DEBUG
+// before compiling this file to route them elsewhere.  Debug messages are
+// only compiled in with __RTMIDI_DEBUG__.
+#if !defined(RTMIDI_LOG_WARN)
+  #define RTMIDI_LOG_WARN( msg ) do { std::cerr << msg; } while ( 0 )
+#endif
+#if !defined(RTMIDI_LOG_DEBUG)
+  #if defined(__RTMIDI_DEBUG__)
+    #define RTMIDI_LOG_DEBUG( msg ) do { std::cerr << msg; } while ( 0 )
+  #else
+    #define RTMIDI_LOG_DEBUG( msg ) do {} while ( 0 )
+  #endif
+#endif
 
 #if defined(TARGET_OS_IPHONE)
 
@@ -115,9 +132,11 @@ class MidiOutCore: public MidiOutApi
   unsigned int getPortCount( void );
   std::string getPortName( unsigned int portNumber );
   void sendMessage( const unsigned char *message, size_t size );
+  void sendMessages( const RtMidiOut::Message *messages, size_t count );
 
  protected:
   void initialize( const std::string& clientName );
+  void sendPacketList( const MIDIPacketList *packetList );
 };
 
 #endif
@@ -184,9 +203,63 @@ class MidiInAlsa: public MidiInApi
   void setPortName( const std::string &portName);
   unsigned int getPortCount( void );
   std::string getPortName( unsigned int portNumber );
+  void setThreadOptions( const RtMidiIn::ThreadOptions &options );
+  void ignoreTypes( bool midiSysex, bool midiTime, bool midiSense );
+  void acceptChannelMessages( unsigned int kinds );
+
+ protected:
+  void initialize( const std::string& clientName );
+  void applyThreadOptions( void );
+  void applyEventFilter( void );
+  void watchPortList( void );
+  void startPortWatch( void );
+  void stopPortWatch( void );
+};
+
+// All the instances share one sequencer client and one input thread.
+// The callbacks are called with the shared client unlocked, so they may
+// close a port or change the filters; closing the port of the callback
+// drops the rest of its batch.
+class MidiInAlsaShared: public MidiInApi
+{
+ public:
+  MidiInAlsaShared( const std::string &clientName, unsigned int queueSizeLimit );
+  ~MidiInAlsaShared( void );
+  RtMidi::Api getCurrentApi( void ) { return RtMidi::LINUX_ALSA_SHARED; };
+  void openPort( unsigned int portNumber, const std::string &portName );
+  void openVirtualPort( const std::string &portName );
+  void closePort( void );
+  void setClientName( const std::string &clientName );
+  void setPortName( const std::string &portName);
+  unsigned int getPortCount( void );
+  std::string getPortName( unsigned int portNumber );
+  void setThreadOptions( const RtMidiIn::ThreadOptions &options );
+  void ignoreTypes( bool midiSysex, bool midiTime, bool midiSense );
+  void acceptChannelMessages( unsigned int kinds );
+
+ protected:
+  void initialize( const std::string& clientName );
+  void applyEventFilter( void );
+};
+
+class MidiInAlsaRaw: public MidiInApi
+{
+ public:
+  MidiInAlsaRaw( const std::string &clientName, unsigned int queueSizeLimit );
+  ~MidiInAlsaRaw( void );
+  RtMidi::Api getCurrentApi( void ) { return RtMidi::LINUX_ALSA_RAW; };
+  void openPort( unsigned int portNumber, const std::string &portName );
+  void openVirtualPort( const std::string &portName );
+  void closePort( void );
+  void setClientName( const std::string &clientName );
+  void setPortName( const std::string &portName);
+  unsigned int getPortCount( void );
+  std::string getPortName( unsigned int portNumber );
+  void setThreadOptions( const RtMidiIn::ThreadOptions &options );
 
  protected:
   void initialize( const std::string& clientName );
+  void applyThreadOptions( void );
 };
 
 class MidiOutAlsa: public MidiOutApi
@@ -203,9 +276,11 @@ class MidiOutAlsa: public MidiOutApi
   unsigned int getPortCount( void );
   std::string getPortName( unsigned int portNumber );
   void sendMessage( const unsigned char *message, size_t size );
+  void sendMessages( const RtMidiOut::Message *messages, size_t count );
 
  protected:
   void initialize( const std::string& clientName );
+  bool outputMessage( const unsigned char *message, size_t size );
 };
 
 #endif
@@ -228,6 +303,9 @@ class MidiInWinMM: public MidiInApi
 
  protected:
   void initialize( const std::string& clientName );
+  void watchPortList( void );
+  void startPortWatch( void );
+  void stopPortWatch( void );
 };
 
 class MidiOutWinMM: public MidiOutApi
@@ -310,6 +388,11 @@ std::string RtMidi :: getVersion( void ) throw()
   return std::string( RTMIDI_VERSION );
 }
 
+unsigned long long RtMidi :: getTimeNs( void )
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
 // Define API names and display names.
 // Must be in same order as API enum.
 extern "C" {
@@ -320,6 +403,8 @@ const char* rtmidi_api_names[][2] = {
   { "jack"        , "Jack" },
   { "winmm"       , "Windows MultiMedia" },
   { "dummy"       , "Dummy" },
+  { "alsaraw"     , "ALSA RawMidi" },
+  { "alsashared"  , "ALSA Shared Client" },
 };
 const unsigned int rtmidi_num_api_names =
   sizeof(rtmidi_api_names)/sizeof(rtmidi_api_names[0]);
@@ -341,6 +426,10 @@ extern "C" const RtMidi::Api rtmidi_compiled_apis[] = {
 #endif
 #if defined(__RTMIDI_DUMMY__)
   RtMidi::RTMIDI_DUMMY,
+#endif
+#if defined(__LINUX_ALSA__)
+  RtMidi::LINUX_ALSA_RAW,
+  RtMidi::LINUX_ALSA_SHARED,
 #endif
   RtMidi::UNSPECIFIED,
 };
@@ -412,6 +501,10 @@ void RtMidiIn :: openMidiApi( RtMidi::Api api, const std::string &clientName, un
 #if defined(__LINUX_ALSA__)
   if ( api == LINUX_ALSA )
     rtapi_ = new MidiInAlsa( clientName, queueSizeLimit );
+  if ( api == LINUX_ALSA_RAW )
+    rtapi_ = new MidiInAlsaRaw( clientName, queueSizeLimit );
+  if ( api == LINUX_ALSA_SHARED )
+    rtapi_ = new MidiInAlsaShared( clientName, queueSizeLimit );
 #endif
 #if defined(__WINDOWS_MM__)
   if ( api == WINDOWS_MM )
@@ -437,7 +530,7 @@ RTMIDI_DLL_PUBLIC RtMidiIn :: RtMidiIn( RtMidi::Api api, const std::string &clie
 
     // No compiled support for specified API value.  Issue a warning
     // and continue as if no API was specified.
-    std::cerr << "\nRtMidiIn: no compiled support for specified API argument!\n\n" << std::endl;
+    RTMIDI_LOG_WARN( "\nRtMidiIn: no compiled support for specified API argument!\n\n" );
   }
 
   // Iterate through the compiled APIs and return as soon as we find
@@ -445,6 +538,9 @@ RTMIDI_DLL_PUBLIC RtMidiIn :: RtMidiIn( RtMidi::Api api, const std::string &clie
   std::vector< RtMidi::Api > apis;
   getCompiledApi( apis );
   for ( unsigned int i=0; i<apis.size(); i++ ) {
+    // The ALSA rawmidi and shared client APIs have no port list
+    // notifications, they are only used when asked for.
+    if ( apis[i] == LINUX_ALSA_RAW || apis[i] == LINUX_ALSA_SHARED ) continue;
     openMidiApi( apis[i], clientName, queueSizeLimit );
     if ( rtapi_ && rtapi_->getPortCount() ) break;
   }
@@ -504,7 +600,7 @@ RTMIDI_DLL_PUBLIC RtMidiOut :: RtMidiOut( RtMidi::Api api, const std::string &cl
 
     // No compiled support for specified API value.  Issue a warning
     // and continue as if no API was specified.
-    std::cerr << "\nRtMidiOut: no compiled support for specified API argument!\n\n" << std::endl;
+    RTMIDI_LOG_WARN( "\nRtMidiOut: no compiled support for specified API argument!\n\n" );
   }
 
   // Iterate through the compiled APIs and return as soon as we find
@@ -512,6 +608,8 @@ RTMIDI_DLL_PUBLIC RtMidiOut :: RtMidiOut( RtMidi::Api api, const std::string &cl
   std::vector< RtMidi::Api > apis;
   getCompiledApi( apis );
   for ( unsigned int i=0; i<apis.size(); i++ ) {
+    // There is no output for the ALSA rawmidi and shared client APIs.
+    if ( apis[i] == LINUX_ALSA_RAW || apis[i] == LINUX_ALSA_SHARED ) continue;
     openMidiApi( apis[i], clientName );
     if ( rtapi_ && rtapi_->getPortCount() ) break;
   }
@@ -565,14 +663,13 @@ void MidiApi :: error( RtMidiError::Type type, std::string errorString )
   }
 
   if ( type == RtMidiError::WARNING ) {
-    std::cerr << '\n' << errorString << "\n\n";
+    RTMIDI_LOG_WARN( '\n' << errorString << "\n\n" );
   }
   else if ( type == RtMidiError::DEBUG_WARNING ) {
-#if defined(__RTMIDI_DEBUG__)
-    std::cerr << '\n' << errorString << "\n\n";
-#endif
+    RTMIDI_LOG_DEBUG( '\n' << errorString << "\n\n" );
   }
   else {
+    // Fatal errors are always printed, whatever the log configuration.
     std::cerr << '\n' << errorString << "\n\n";
     throw RtMidiError( errorString, type );
   }
@@ -588,7 +685,9 @@ MidiInApi :: MidiInApi( unsigned int queueSizeLimit )
   // Allocate the MIDI queue.
   inputData_.queue.ringSize = queueSizeLimit;
   if ( inputData_.queue.ringSize > 0 )
-    inputData_.queue.ring = new MidiMessage[ inputData_.queue.ringSize ];
+    inputData_.queue.ring = new QueueSlot[ inputData_.queue.ringSize ];
+
+  // The sysex buffer is allocated by ignoreTypes(), sysex messages are ignored by default.
 }
 
 MidiInApi :: ~MidiInApi( void )
@@ -616,6 +715,44 @@ void MidiInApi :: setCallback( RtMidiIn::RtMidiCallback callback, void *userData
   inputData_.usingCallback = true;
 }
 
+void MidiInApi :: setRawCallback( RtMidiIn::RtMidiRawCallback callback, void *userData )
+{
+  if ( inputData_.usingCallback ) {
+    errorString_ = "MidiInApi::setRawCallback: a callback function is already set!";
+    error( RtMidiError::WARNING, errorString_ );
+    return;
+  }
+
+  if ( !callback ) {
+    errorString_ = "RtMidiIn::setRawCallback: callback function value is invalid!";
+    error( RtMidiError::WARNING, errorString_ );
+    return;
+  }
+
+  inputData_.rawCallback = callback;
+  inputData_.userData = userData;
+  inputData_.usingCallback = true;
+}
+
+void MidiInApi :: setBatchCallback( RtMidiIn::RtMidiBatchCallback callback, void *userData )
+{
+  if ( inputData_.usingCallback ) {
+    errorString_ = "MidiInApi::setBatchCallback: a callback function is already set!";
+    error( RtMidiError::WARNING, errorString_ );
+    return;
+  }
+
+  if ( !callback ) {
+    errorString_ = "RtMidiIn::setBatchCallback: callback function value is invalid!";
+    error( RtMidiError::WARNING, errorString_ );
+    return;
+  }
+
+  inputData_.batchCallback = callback;
+  inputData_.userData = userData;
+  inputData_.usingCallback = true;
+}
+
 void MidiInApi :: cancelCallback()
 {
   if ( !inputData_.usingCallback ) {
@@ -625,19 +762,31 @@ void MidiInApi :: cancelCallback()
   }
 
   inputData_.userCallback = 0;
+  inputData_.rawCallback = 0;
+  inputData_.batchCallback = 0;
   inputData_.userData = 0;
   inputData_.usingCallback = false;
 }
 
 void MidiInApi :: ignoreTypes( bool midiSysex, bool midiTime, bool midiSense )
 {
-  inputData_.ignoreFlags = 0;
-  if ( midiSysex ) inputData_.ignoreFlags = 0x01;
-  if ( midiTime ) inputData_.ignoreFlags |= 0x02;
-  if ( midiSense ) inputData_.ignoreFlags |= 0x04;
+  // Allocated before the input thread may use it: it does not touch the
+  // buffer while sysex messages are ignored.  Kept once allocated.
+  if ( !midiSysex ) inputData_.sysex.allocate();
+
+  unsigned char ignoreFlags = 0;
+  if ( midiSysex ) ignoreFlags = 0x01;
+  if ( midiTime ) ignoreFlags |= 0x02;
+  if ( midiSense ) ignoreFlags |= 0x04;
+  inputData_.ignoreFlags.store( ignoreFlags, std::memory_order_relaxed );
+}
+
+void MidiInApi :: acceptChannelMessages( unsigned int kinds )
+{
+  inputData_.channelKinds.store( (unsigned char) ( kinds & RtMidiIn::ALL_CHANNEL_MESSAGES ), std::memory_order_relaxed );
 }
 
-double MidiInApi :: getMessage( std::vector<unsigned char> *message )
+double MidiInApi :: getMessage( std::vector<unsigned char> *message, unsigned long long *timeStampNs )
 {
   message->clear();
 
@@ -648,190 +797,720 @@ double MidiInApi :: getMessage( std::vector<unsigned char> *message )
   }
 
   double timeStamp;
-  if ( !inputData_.queue.pop( message, &timeStamp ) )
+  if ( !inputData_.queue.pop( message, &timeStamp, timeStampNs ) )
     return 0.0;
 
   return timeStamp;
 }
 
-unsigned int MidiInApi::MidiQueue::size( unsigned int *__back,
-                                         unsigned int *__front )
+RtMidiIn::QueueStats MidiInApi :: getQueueStats( void )
+{
+  RtMidiIn::QueueStats stats;
+  stats.pushes = inputData_.queue.pushes.load( std::memory_order_relaxed );
+  stats.pops = inputData_.queue.pops.load( std::memory_order_relaxed );
+  stats.drops = inputData_.queue.drops.load( std::memory_order_relaxed );
+  stats.coalesced = inputData_.queue.coalesced.load( std::memory_order_relaxed );
+  stats.maxDepth = inputData_.queue.maxDepth.load( std::memory_order_relaxed );
+  stats.depth = inputData_.queue.ringSize > 0 ? inputData_.queue.size() : 0;
+  stats.capacity = inputData_.queue.ringSize > 0 ? inputData_.queue.ringSize - 1 : 0;
+  return stats;
+}
+
+void MidiInApi :: resetQueueStats( void )
 {
-  // Access back/front members exactly once and make stack copies for
-  // size calculation
-  unsigned int _back = back, _front = front, _size;
-  if ( _back >= _front )
-    _size = _back - _front;
-  else
-    _size = ringSize - _front + _back;
+  inputData_.queue.pushes.store( 0, std::memory_order_relaxed );
+  inputData_.queue.pops.store( 0, std::memory_order_relaxed );
+  inputData_.queue.drops.store( 0, std::memory_order_relaxed );
+  inputData_.queue.coalesced.store( 0, std::memory_order_relaxed );
+  inputData_.queue.maxDepth.store( 0, std::memory_order_relaxed );
+}
 
-  // Return copies of back/front so no new and unsynchronized accesses
-  // to member variables are needed.
-  if ( __back ) *__back = _back;
-  if ( __front ) *__front = _front;
-  return _size;
+void MidiInApi :: setQueueOverflowCallback( RtMidiIn::RtMidiQueueOverflowCallback callback, void *userData )
+{
+  inputData_.queue.overflowCallback = callback;
+  inputData_.queue.overflowUserData = userData;
 }
 
-// As long as we haven't reached our queue size limit, push the message.
-bool MidiInApi::MidiQueue::push( const MidiInApi::MidiMessage& msg )
+void MidiInApi :: setQueueOverflowPolicy( RtMidiIn::QueueOverflowPolicy policy )
 {
-  // Local stack copies of front/back
-  unsigned int _back, _front, _size;
+  if ( connected_ || inputData_.doInput ) {
+    errorString_ = "MidiInApi::setQueueOverflowPolicy: the queue overflow policy cannot be changed while a port is open.";
+    error( RtMidiError::WARNING, errorString_ );
+    return;
+  }
 
-  // Get back/front indexes exactly once and calculate current size
-  _size = size( &_back, &_front );
+  inputData_.queue.policy = policy;
+}
 
-  if ( _size < ringSize-1 )
-  {
-    ring[_back] = msg;
-    back = (back+1)%ringSize;
-    return true;
+void MidiInApi :: setCoalescedControllers( const std::vector<unsigned char> &controllers )
+{
+  if ( connected_ || inputData_.doInput ) {
+    errorString_ = "MidiInApi::setCoalescedControllers: the coalesced controllers cannot be changed while a port is open.";
+    error( RtMidiError::WARNING, errorString_ );
+    return;
   }
 
-  return false;
+  std::fill( inputData_.queue.coalescedControllers, inputData_.queue.coalescedControllers + 128, false );
+  for ( size_t i=0; i<controllers.size(); ++i )
+    if ( controllers[i] < 128 ) inputData_.queue.coalescedControllers[controllers[i]] = true;
 }
 
-bool MidiInApi::MidiQueue::pop( std::vector<unsigned char> *msg, double* timeStamp )
+void MidiInApi :: setSysexBufferSize( unsigned int size )
 {
-  // Local stack copies of front/back
-  unsigned int _back, _front, _size;
+  if ( connected_ || inputData_.doInput ) {
+    errorString_ = "MidiInApi::setSysexBufferSize: the sysex buffer size cannot be changed while a port is open.";
+    error( RtMidiError::WARNING, errorString_ );
+    return;
+  }
 
-  // Get back/front indexes exactly once and calculate current size
-  _size = size( &_back, &_front );
+  inputData_.sysex.clear();
+  inputData_.sysex.capacity = size;
+  inputData_.sysex.bytes.clear();
+  inputData_.sysex.bytes.shrink_to_fit();
+  if ( !( inputData_.ignoreFlags.load( std::memory_order_relaxed ) & 0x01 ) ) inputData_.sysex.allocate();
+}
 
-  if ( _size == 0 )
-    return false;
+void MidiInApi :: setThreadOptions( const RtMidiIn::ThreadOptions &options )
+{
+  threadOptions_ = options;
+  if ( options.policy == RtMidiIn::THREAD_POLICY_DEFAULT && options.cpu < 0 && !options.lockMemory )
+    return;
 
-  // Copy queued message to the vector pointer argument and then "pop" it.
-  msg->assign( ring[_front].bytes.begin(), ring[_front].bytes.end() );
-  *timeStamp = ring[_front].timeStamp;
+  errorString_ = "MidiInApi::setThreadOptions: thread options are not supported by this API.";
+  error( RtMidiError::WARNING, errorString_ );
+}
 
-  // Update front
-  front = (front+1)%ringSize;
-  return true;
+unsigned long long MidiInApi :: getPortListGeneration( void )
+{
+  if ( !inputData_.portList.enabled ) {
+    // No notifications from this API, compare with a fresh enumeration.
+    std::vector<std::string> ports;
+    unsigned int nPorts = getPortCount();
+    for ( unsigned int i=0; i<nPorts; ++i )
+      ports.push_back( getPortName( i ) );
+    inputData_.portList.update( ports );
+  }
+
+  return inputData_.portList.generation.load();
 }
 
-//*********************************************************************//
-//  Common MidiOutApi Definitions
-//*********************************************************************//
+void MidiInApi :: setPortListCallback( RtMidiIn::RtMidiPortListCallback callback, void *userData )
+{
+  {
+    std::lock_guard<std::mutex> lock( inputData_.portList.mutex );
+    inputData_.portList.callback = callback;
+    inputData_.portList.userData = userData;
+  }
 
-MidiOutApi :: MidiOutApi( void )
-  : MidiApi()
+  // Outside of the lock, starting the watch fills the cache.
+  if ( callback ) watchPortList();
+}
+
+void MidiInApi::PortListCache :: update( const std::vector<std::string> &ports )
 {
+  RtMidiIn::RtMidiPortListCallback notify;
+  void *notifyUserData;
+  unsigned long long newGeneration;
+  {
+    std::lock_guard<std::mutex> lock( mutex );
+    if ( ports == names ) return;
+    names = ports;
+    newGeneration = ++generation;
+    notify = callback;
+    notifyUserData = userData;
+  }
+
+  // Called without the lock, so that the callback may query the list.
+  if ( notify ) notify( newGeneration, notifyUserData );
 }
 
-MidiOutApi :: ~MidiOutApi( void )
+bool MidiInApi::PortListCache :: matches( const std::vector<std::string> &ports )
 {
+  std::lock_guard<std::mutex> lock( mutex );
+  return ports == names;
 }
 
-// *************************************************** //
-//
-// OS/API-specific methods.
-//
-// *************************************************** //
+unsigned int MidiInApi::PortListCache :: count( void )
+{
+  std::lock_guard<std::mutex> lock( mutex );
+  return (unsigned int) names.size();
+}
 
-#if defined(__MACOSX_CORE__)
+bool MidiInApi::PortListCache :: name( unsigned int portNumber, std::string &portName )
+{
+  std::lock_guard<std::mutex> lock( mutex );
+  if ( portNumber >= names.size() ) return false;
+  portName = names[portNumber];
+  return true;
+}
 
-// The CoreMIDI API is based on the use of a callback function for
-// MIDI input.  We convert the system specific time stamps to delta
-// time values.
+void MidiInApi::RtMidiInData :: dispatch( const unsigned char *message, size_t size, double timeStamp, unsigned long long timeStampNs )
+{
+  if ( !accepts( message ) ) return;
 
-// OS-X CoreMIDI header files.
-#include <CoreMIDI/CoreMIDI.h>
+  if ( usingCallback ) {
+    if ( rawCallback ) {
+      rawCallback( timeStampNs, message, size, userData );
+    }
+    else if ( batchCallback ) {
+      RtMidiIn::MessageView view = { message, size, timeStamp, timeStampNs };
+      batchCallback( &view, 1, userData );
+    }
+    else {
+      callbackBytes.assign( message, message + size );
+      userCallback( timeStamp, &callbackBytes, userData );
+    }
+  }
+  else {
+    // push() applies the overflow policy when the queue is full.
+    queue.push( message, size, timeStamp, timeStampNs );
+  }
+}
 
-// these are not available on iOS. 
-#if (TARGET_OS_IPHONE == 0)
-  #include <CoreAudio/HostTime.h>
-  #include <CoreServices/CoreServices.h>
-#endif
+void MidiInApi::RtMidiInData :: addToBatch( MessageBatch &batch, const unsigned char *message, size_t size, double timeStamp, unsigned long long timeStampNs )
+{
+  if ( !accepts( message ) ) return;
 
-// A structure to hold variables related to the CoreMIDI API
-// implementation.
-struct CoreMidiData {
-  MIDIClientRef client;
-  MIDIPortRef port;
-  MIDIEndpointRef endpoint;
-  MIDIEndpointRef destinationId;
-  unsigned long long lastTime;
-  MIDISysexSendRequest sysexreq;
-};
+  if ( batch.add( message, size, timeStamp, timeStampNs ) ) return;
 
-//*********************************************************************//
-//  API: OS-X
-//  Class Definitions: MidiInCore
-//*********************************************************************//
+  dispatch( batch );
+  if ( batch.add( message, size, timeStamp, timeStampNs ) ) return;
 
-static void midiInputCallback( const MIDIPacketList *list, void *procRef, void */*srcRef*/ )
+  // Larger than a whole batch (long sysex), deliver it on its own.
+  dispatch( message, size, timeStamp, timeStampNs );
+}
+
+void MidiInApi::RtMidiInData :: dispatch( MessageBatch &batch )
 {
-  MidiInApi::RtMidiInData *data = static_cast<MidiInApi::RtMidiInData *> (procRef);
-  CoreMidiData *apiData = static_cast<CoreMidiData *> (data->apiData);
+  if ( batch.count == 0 ) return;
 
-  unsigned char status;
-  unsigned short nBytes, iByte, size;
-  unsigned long long time;
+  if ( !usingCallback ) {
+    queue.push( batch.messages, batch.count );
+  }
+  else if ( batchCallback ) {
+    batchCallback( batch.messages, batch.count, userData );
+  }
+  else {
+    for ( size_t i=0; i<batch.count; ++i )
+      dispatch( batch.messages[i].bytes, batch.messages[i].size, batch.messages[i].deltaTime, batch.messages[i].timeStamp );
+  }
 
-  bool& continueSysex = data->continueSysex;
-  MidiInApi::MidiMessage& message = data->message;
+  batch.count = 0;
+  batch.used = 0;
+}
 
-  const MIDIPacket *packet = &list->packet[0];
-  for ( unsigned int i=0; i<list->numPackets; ++i ) {
+void MidiInApi::SysexBuffer :: append( const unsigned char *data, size_t count )
+{
+  if ( overflow ) return;
 
-    // My interpretation of the CoreMIDI documentation: all message
-    // types, except sysex, are complete within a packet and there may
-    // be several of them in a single packet.  Sysex messages can be
-    // broken across multiple packets and PacketLists but are bundled
-    // alone within each packet (these packets do not contain other
-    // message types).  If sysex messages are split across multiple
-    // MIDIPacketLists, they must be handled by multiple calls to this
-    // function.
+  if ( count > bytes.size() - size ) {
+    overflow = true;
+    RTMIDI_LOG_WARN( "\nRtMidiIn: sysex message larger than the sysex buffer (" << bytes.size() << " bytes), dropping it!\n\n" );
+    return;
+  }
 
-    nBytes = packet->length;
-    if ( nBytes == 0 ) {
-      packet = MIDIPacketNext( packet );
-      continue;
-    }
+  std::copy( data, data + count, bytes.begin() + size );
+  size += count;
+}
 
-    // Calculate time stamp.
-    if ( data->firstMessage ) {
-      message.timeStamp = 0.0;
-      data->firstMessage = false;
+bool MidiInApi::MessageBatch :: add( const unsigned char *message, size_t size, double deltaTime, unsigned long long timeStamp )
+{
+  if ( count == RTMIDI_BATCH_MESSAGES || size > RTMIDI_BATCH_BYTES - used )
+    return false;
+
+  std::copy( message, message + size, bytes + used );
+  RtMidiIn::MessageView &view = messages[count++];
+  view.bytes = bytes + used;
+  view.size = size;
+  view.deltaTime = deltaTime;
+  view.timeStamp = timeStamp;
+  used += size;
+  return true;
+}
+
+const MidiInApi::MidiParser::ByteTable MidiInApi::MidiParser::table;
+
+MidiInApi::MidiParser::ByteTable :: ByteTable( void )
+{
+  for ( int i=0; i<256; ++i ) {
+    unsigned char type = i & 0xF0;
+    ignoreFlag[i] = 0;
+    if ( i < 0x80 ) {
+      kind[i] = DATA;
+      length[i] = 0;
+    }
+    else if ( i < 0xF0 ) {
+      kind[i] = CHANNEL;
+      length[i] = ( type == 0xC0 || type == 0xD0 ) ? 2 : 3;
+    }
+    else if ( i >= 0xF8 ) {
+      kind[i] = REALTIME;
+      length[i] = 1;
     }
     else {
-      time = packet->timeStamp;
-      if ( time == 0 ) { // this happens when receiving asynchronous sysex messages
-        time = AudioGetCurrentHostTime();
-      }
-      time -= apiData->lastTime;
-      time = AudioConvertHostTimeToNanos( time );
-      if ( !continueSysex )
-        message.timeStamp = time * 0.000000001;
+      kind[i] = COMMON;
+      length[i] = 1;
     }
+  }
 
-    // Track whether any non-filtered messages were found in this
-    // packet for timestamp calculation
-    bool foundNonFiltered = false;
+  kind[0xF0] = SYSEX;
+  kind[0xF7] = EOX;
+  length[0xF1] = 2; // MIDI time code quarter frame
+  length[0xF2] = 3; // song position
+  length[0xF3] = 2; // song select
+
+  ignoreFlag[0xF0] = 0x01;
+  ignoreFlag[0xF7] = 0x01;
+  ignoreFlag[0xF1] = 0x02;
+  ignoreFlag[0xF8] = 0x02;
+  ignoreFlag[0xF9] = 0x02;
+  ignoreFlag[0xFE] = 0x04;
+}
 
-    iByte = 0;
-    if ( continueSysex ) {
-      // We have a continuing, segmented sysex message.
-      if ( !( data->ignoreFlags & 0x01 ) ) {
-        // If we're not ignoring sysex messages, copy the entire packet.
-        for ( unsigned int j=0; j<nBytes; ++j )
-          message.bytes.push_back( packet->data[j] );
+void MidiInApi::MidiParser :: reset( void )
+{
+  messageSize = 0;
+  runningStatus = 0;
+  inSysex = false;
+  lastTimeNs = 0;
+}
+
+void MidiInApi::MidiParser :: parse( RtMidiInData &data, MessageBatch &batch, const unsigned char *bytes, size_t size, unsigned long long timeStampNs )
+{
+  for ( size_t i=0; i<size; ++i ) {
+    unsigned char byte = bytes[i];
+
+    switch ( table.kind[byte] ) {
+
+    case DATA:
+      if ( inSysex ) {
+        // Copy the whole run of sysex data bytes at once.
+        size_t end = i + 1;
+        while ( end < size && bytes[end] < 0x80 ) ++end;
+        if ( !( data.ignoreFlags.load( std::memory_order_relaxed ) & 0x01 ) ) data.sysex.append( bytes + i, end - i );
+        i = end - 1;
+        break;
       }
-      continueSysex = packet->data[nBytes-1] != 0xF7;
+      if ( messageSize == 0 ) {
+        // A data byte without status: use the running status, if any.
+        if ( runningStatus == 0 ) break;
+        message[messageSize++] = runningStatus;
+      }
+      message[messageSize++] = byte;
+      if ( messageSize == table.length[message[0]] ) {
+        messageSize = 0;
+        if ( !( data.ignoreFlags.load( std::memory_order_relaxed ) & table.ignoreFlag[message[0]] ) )
+          add( data, batch, message, table.length[message[0]], timeStampNs );
+      }
+      break;
 
-      if ( !( data->ignoreFlags & 0x01 ) && !continueSysex ) {
+    case CHANNEL:
+      // A status byte ends any unterminated sysex, which is dropped.
+      inSysex = false;
+      runningStatus = byte;
+      message[0] = byte;
+      messageSize = 1;
+      break;
+
+    case COMMON:
+      inSysex = false;
+      runningStatus = 0;
+      message[0] = byte;
+      messageSize = 1;
+      if ( table.length[byte] == 1 ) {
+        messageSize = 0;
+        if ( !( data.ignoreFlags.load( std::memory_order_relaxed ) & table.ignoreFlag[byte] ) )
+          add( data, batch, message, 1, timeStampNs );
+      }
+      break;
+
+    case SYSEX:
+      runningStatus = 0;
+      messageSize = 0;
+      inSysex = true;
+      data.sysex.clear();
+      if ( !( data.ignoreFlags.load( std::memory_order_relaxed ) & 0x01 ) ) data.sysex.append( &byte, 1 );
+      break;
+
+    case EOX:
+      runningStatus = 0;
+      messageSize = 0;
+      if ( !inSysex ) break;
+      inSysex = false;
+      if ( data.ignoreFlags.load( std::memory_order_relaxed ) & 0x01 ) break;
+      data.sysex.append( &byte, 1 );
+      if ( !data.sysex.overflow )
+        add( data, batch, data.sysex.bytes.data(), data.sysex.size, timeStampNs );
+      break;
+
+    case REALTIME:
+      // Real-time messages may appear anywhere, even inside another
+      // message, and leave the parser state alone.
+      if ( !( data.ignoreFlags.load( std::memory_order_relaxed ) & table.ignoreFlag[byte] ) )
+        add( data, batch, &byte, 1, timeStampNs );
+      break;
+    }
+  }
+}
+
+void MidiInApi::MidiParser :: add( RtMidiInData &data, MessageBatch &batch, const unsigned char *bytes, size_t size, unsigned long long timeStampNs )
+{
+  double timeStamp = 0.0;
+  if ( data.firstMessage == true )
+    data.firstMessage = false;
+  else
+    timeStamp = ( timeStampNs - lastTimeNs ) * 0.000000001;
+  lastTimeNs = timeStampNs;
+
+  data.addToBatch( batch, bytes, size, timeStamp, timeStampNs );
+}
+
+unsigned int MidiInApi::MidiQueue::size( unsigned int *__back,
+                                         unsigned int *__front )
+{
+  // Access back/front members exactly once and make stack copies for
+  // size calculation.  The acquire loads pair with the release stores
+  // in push() and pop(), so the slot contents are visible to whichever
+  // side sees the updated index.
+  unsigned int _back = back.load( std::memory_order_acquire );
+  unsigned int _front = front.load( std::memory_order_acquire );
+  unsigned int _size;
+  if ( _back >= _front )
+    _size = _back - _front;
+  else
+    _size = ringSize - _front + _back;
+
+  // Return copies of back/front so no new and unsynchronized accesses
+  // to member variables are needed.
+  if ( __back ) *__back = _back;
+  if ( __front ) *__front = _front;
+  return _size;
+}
+
+// Pushes a single message, applying the overflow policy if the queue is full.
+// Must only be called from the input thread.
+bool MidiInApi::MidiQueue::push( const unsigned char *message, size_t nBytes, double timeStamp, unsigned long long timeStampNs )
+{
+  RtMidiIn::MessageView view = { message, nBytes, timeStamp, timeStampNs };
+  return push( &view, 1 ) == 1;
+}
+
+// Pushes as many messages as fit and publishes them to the reader with a
+// single index update.  Returns the number of messages stored.
+// Must only be called from the input thread.
+size_t MidiInApi::MidiQueue::push( const RtMidiIn::MessageView *messages, size_t count )
+{
+  // Local stack copies of front/back
+  unsigned int _back, _front, _size;
+
+  // Get back/front indexes exactly once and calculate current size
+  _size = size( &_back, &_front );
+
+  size_t stored = 0;
+  size_t dropped = 0;
+  for ( size_t i=0; i<count; ++i )
+  {
+    const RtMidiIn::MessageView &msg = messages[i];
+    if ( _size >= ringSize-1 ) {
+      if ( policy == RtMidiIn::QUEUE_DROP_NEWEST ) {
+        dropped += count - i;
+        break;
+      }
+
+      // Publish the slots written so far, the overflow policy works on them.
+      back.store( _back, std::memory_order_release );
+      Overflow result = overflow( msg, _size );
+      if ( result == OLDEST_DROPPED || result == NEWEST_DROPPED ) ++dropped;
+      if ( result == COALESCED || result == NEWEST_DROPPED ) continue;
+    }
+
+    QueueSlot &slot = ring[_back];
+    if ( msg.size <= sizeof(slot.shortBytes) )
+      std::copy( msg.bytes, msg.bytes + msg.size, slot.shortBytes );
+    else
+      slot.longBytes.assign( msg.bytes, msg.bytes + msg.size );
+    slot.size = (unsigned int) msg.size;
+    slot.timeStamp = msg.deltaTime;
+    slot.timeStampNs = msg.timeStamp;
+
+    _back = (_back+1)%ringSize;
+    ++_size;
+    ++stored;
+  }
+
+  if ( stored > 0 ) {
+    // Publish the slots to the reader.
+    back.store( _back, std::memory_order_release );
+    pushes.fetch_add( stored, std::memory_order_relaxed );
+    if ( _size > maxDepth.load( std::memory_order_relaxed ) )
+      maxDepth.store( _size, std::memory_order_relaxed );
+  }
+
+  // Only the first overflow is reported, the following ones are counted.
+  if ( dropped > 0 && drops.fetch_add( dropped, std::memory_order_relaxed ) == 0 ) {
+    if ( overflowCallback )
+      overflowCallback( ringSize, overflowUserData );
+    else
+      RTMIDI_LOG_WARN( "\nRtMidiIn: message queue limit reached, further overflows are only counted!!\n\n" );
+  }
+  return stored;
+}
+
+// Applies the overflow policy to a message arriving in a full queue.
+// Returns ROOM_FREE or OLDEST_DROPPED when the message can be stored in
+// the slot at back, and updates _size.  Must only be called from the
+// input thread, with everything written so far published.
+MidiInApi::MidiQueue::Overflow MidiInApi::MidiQueue::overflow( const RtMidiIn::MessageView &msg, unsigned int &_size )
+{
+  unsigned int _back, _front;
+  _size = size( &_back, &_front );
+
+  if ( _size < ringSize-1 ) {
+    // The reader made room in the meantime.
+    return ROOM_FREE;
+  }
+
+  if ( policy == RtMidiIn::QUEUE_DROP_OLDEST && _size > 0 ) {
+    // A reader that announced a slot before it was evicted may still be
+    // copying it out, and that slot is the one at back.
+    if ( reading.load() == _back )
+      return NEWEST_DROPPED;
+    if ( !front.compare_exchange_strong( _front, (_front+1)%ringSize ) ) {
+      // The reader popped it first.
+      _size = size();
+      return ROOM_FREE;
+    }
+    --_size;
+    return OLDEST_DROPPED;
+  }
+
+  if ( policy == RtMidiIn::QUEUE_COALESCE_CC && msg.size == 3 && ( msg.bytes[0] & 0xF0 ) == 0xB0 &&
+       msg.bytes[1] < 128 && coalescedControllers[msg.bytes[1]] )
+    return coalesce( msg, _size );
+
+  return NEWEST_DROPPED;
+}
+
+// Merges a control change into the most recent queued one of the same
+// channel and controller.  Must only be called from overflow().
+MidiInApi::MidiQueue::Overflow MidiInApi::MidiQueue::coalesce( const RtMidiIn::MessageView &msg, unsigned int &_size )
+{
+  unsigned int _back, _front;
+  _size = size( &_back, &_front );
+
+  for ( unsigned int i=_size; i>0; --i ) {
+    unsigned int index = (_front+i-1)%ringSize;
+    QueueSlot &slot = ring[index];
+    if ( slot.size != 3 || slot.shortBytes[0] != msg.bytes[0] || slot.shortBytes[1] != msg.bytes[1] )
+      continue;
+
+    // Announce the slot, then make sure the reader is neither copying it
+    // out nor done with it.  A reader announcing it from now on waits
+    // for the rewrite to end.
+    rewriting.store( index );
+    Overflow result = COALESCED;
+    if ( reading.load() == index )
+      result = NEWEST_DROPPED;
+    else {
+      unsigned int newFront = front.load();
+      if ( ( index + ringSize - newFront ) % ringSize >= ( _back + ringSize - newFront ) % ringSize ) {
+        // Popped, so there is room for the message now.
+        _size = size();
+        result = ROOM_FREE;
+      }
+      else {
+        if ( msg.timeStamp > slot.timeStampNs )
+          slot.timeStamp += ( msg.timeStamp - slot.timeStampNs ) * 0.000000001;
+        slot.shortBytes[2] = msg.bytes[2];
+        slot.timeStampNs = msg.timeStamp;
+        coalesced.fetch_add( 1, std::memory_order_relaxed );
+      }
+    }
+    rewriting.store( noSlot, std::memory_order_release );
+    return result;
+  }
+
+  return NEWEST_DROPPED;
+}
+
+void MidiInApi::MidiQueue::copySlot( unsigned int index, std::vector<unsigned char> *msg, double *timeStamp, unsigned long long *timeStampNs )
+{
+  const QueueSlot &slot = ring[index];
+  msg->assign( slot.bytes(), slot.bytes() + slot.size );
+  *timeStamp = slot.timeStamp;
+  if ( timeStampNs ) *timeStampNs = slot.timeStampNs;
+}
+
+// Must only be called from the reading thread.
+bool MidiInApi::MidiQueue::pop( std::vector<unsigned char> *msg, double* timeStamp, unsigned long long *timeStampNs )
+{
+  // Local stack copies of front/back
+  unsigned int _back, _front, _size;
+
+  if ( policy == RtMidiIn::QUEUE_DROP_NEWEST ) {
+    // The writer never touches queued slots.
+    _size = size( &_back, &_front );
+    if ( _size == 0 )
+      return false;
+
+    copySlot( _front, msg, timeStamp, timeStampNs );
+
+    // Hand the slot back to the writer.
+    front.store( (_front+1)%ringSize, std::memory_order_release );
+  }
+  else {
+    for ( ;; ) {
+      _size = size( &_back, &_front );
+      if ( _size == 0 )
+        return false;
+
+      // Announce the slot before checking that it is still queued: the
+      // writer either sees the announcement or evicted the slot already.
+      reading.store( _front );
+      if ( front.load() != _front )
+        continue;
+
+      // A rewrite only lasts a few stores of the input thread.
+      while ( rewriting.load() == _front )
+        std::this_thread::yield();
+
+      copySlot( _front, msg, timeStamp, timeStampNs );
+
+      // Claim the slot, unless the writer evicted it while it was copied.
+      bool claimed = front.compare_exchange_strong( _front, (_front+1)%ringSize );
+      reading.store( noSlot, std::memory_order_release );
+      if ( claimed )
+        break;
+    }
+  }
+
+  pops.fetch_add( 1, std::memory_order_relaxed );
+  return true;
+}
+
+//*********************************************************************//
+//  Common MidiOutApi Definitions
+//*********************************************************************//
+
+MidiOutApi :: MidiOutApi( void )
+  : MidiApi()
+{
+}
+
+MidiOutApi :: ~MidiOutApi( void )
+{
+}
+
+void MidiOutApi :: sendMessages( const RtMidiOut::Message *messages, size_t count )
+{
+  for ( size_t i=0; i<count; ++i )
+    sendMessage( messages[i].bytes, messages[i].size );
+}
+
+// *************************************************** //
+//
+// OS/API-specific methods.
+//
+// *************************************************** //
+
+#if defined(__MACOSX_CORE__)
+
+// The CoreMIDI API is based on the use of a callback function for
+// MIDI input.  We convert the system specific time stamps to delta
+// time values.
+
+// OS-X CoreMIDI header files.
+#include <CoreMIDI/CoreMIDI.h>
+
+// these are not available on iOS. 
+#if (TARGET_OS_IPHONE == 0)
+  #include <CoreAudio/HostTime.h>
+  #include <CoreServices/CoreServices.h>
+#endif
+
+// A structure to hold variables related to the CoreMIDI API
+// implementation.
+struct CoreMidiData {
+  MIDIClientRef client;
+  MIDIPortRef port;
+  MIDIEndpointRef endpoint;
+  MIDIEndpointRef destinationId;
+  unsigned long long lastTime;
+  MIDISysexSendRequest sysexreq;
+};
+
+//*********************************************************************//
+//  API: OS-X
+//  Class Definitions: MidiInCore
+//*********************************************************************//
+
+static void midiInputCallback( const MIDIPacketList *list, void *procRef, void */*srcRef*/ )
+{
+  MidiInApi::RtMidiInData *data = static_cast<MidiInApi::RtMidiInData *> (procRef);
+  CoreMidiData *apiData = static_cast<CoreMidiData *> (data->apiData);
+
+  unsigned char status;
+  unsigned short nBytes, iByte, size;
+  unsigned long long time;
+
+  bool& continueSysex = data->continueSysex;
+  MidiInApi::MidiMessage& message = data->message;
+
+  const MIDIPacket *packet = &list->packet[0];
+  for ( unsigned int i=0; i<list->numPackets; ++i ) {
+
+    // My interpretation of the CoreMIDI documentation: all message
+    // types, except sysex, are complete within a packet and there may
+    // be several of them in a single packet.  Sysex messages can be
+    // broken across multiple packets and PacketLists but are bundled
+    // alone within each packet (these packets do not contain other
+    // message types).  If sysex messages are split across multiple
+    // MIDIPacketLists, they must be handled by multiple calls to this
+    // function.
+
+    nBytes = packet->length;
+    if ( nBytes == 0 ) {
+      packet = MIDIPacketNext( packet );
+      continue;
+    }
+
+    // Absolute time stamp, host time is the clock of RtMidi::getTimeNs().
+    // It is zero when receiving asynchronous sysex messages.
+    unsigned long long timeStampNs = AudioConvertHostTimeToNanos( packet->timeStamp ? packet->timeStamp : AudioGetCurrentHostTime() );
+
+    // Calculate time stamp.
+    if ( data->firstMessage ) {
+      message.timeStamp = 0.0;
+      data->firstMessage = false;
+    }
+    else {
+      time = packet->timeStamp;
+      if ( time == 0 ) { // this happens when receiving asynchronous sysex messages
+        time = AudioGetCurrentHostTime();
+      }
+      time -= apiData->lastTime;
+      time = AudioConvertHostTimeToNanos( time );
+      if ( !continueSysex )
+        message.timeStamp = time * 0.000000001;
+    }
+
+    // Track whether any non-filtered messages were found in this
+    // packet for timestamp calculation
+    bool foundNonFiltered = false;
+
+    iByte = 0;
+    if ( continueSysex ) {
+      // We have a continuing, segmented sysex message.
+      if ( !( data->ignoreFlags.load( std::memory_order_relaxed ) & 0x01 ) ) {
+        // If we're not ignoring sysex messages, copy the entire packet.
+        for ( unsigned int j=0; j<nBytes; ++j )
+          message.bytes.push_back( packet->data[j] );
+      }
+      continueSysex = packet->data[nBytes-1] != 0xF7;
+
+      if ( !( data->ignoreFlags.load( std::memory_order_relaxed ) & 0x01 ) && !continueSysex ) {
         // If not a continuing sysex message, invoke the user callback function or queue the message.
-        if ( data->usingCallback ) {
-          RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) data->userCallback;
-          callback( message.timeStamp, &message.bytes, data->userData );
-        }
-        else {
-          // As long as we haven't reached our queue size limit, push the message.
-          if ( !data->queue.push( message ) )
-            std::cerr << "\nMidiInCore: message queue limit reached!!\n\n";
-        }
+        data->dispatch( message.bytes.data(), message.bytes.size(), message.timeStamp, timeStampNs );
         message.bytes.clear();
       }
     }
@@ -847,7 +1526,7 @@ static void midiInputCallback( const MIDIPacketList *list, void *procRef, void *
         else if ( status < 0xF0 ) size = 3;
         else if ( status == 0xF0 ) {
           // A MIDI sysex
-          if ( data->ignoreFlags & 0x01 ) {
+          if ( data->ignoreFlags.load( std::memory_order_relaxed ) & 0x01 ) {
             size = 0;
             iByte = nBytes;
           }
@@ -856,7 +1535,7 @@ static void midiInputCallback( const MIDIPacketList *list, void *procRef, void *
         }
         else if ( status == 0xF1 ) {
           // A MIDI time code message
-          if ( data->ignoreFlags & 0x02 ) {
+          if ( data->ignoreFlags.load( std::memory_order_relaxed ) & 0x02 ) {
             size = 0;
             iByte += 2;
           }
@@ -864,34 +1543,28 @@ static void midiInputCallback( const MIDIPacketList *list, void *procRef, void *
         }
         else if ( status == 0xF2 ) size = 3;
         else if ( status == 0xF3 ) size = 2;
-        else if ( status == 0xF8 && ( data->ignoreFlags & 0x02 ) ) {
+        else if ( status == 0xF8 && ( data->ignoreFlags.load( std::memory_order_relaxed ) & 0x02 ) ) {
           // A MIDI timing tick message and we're ignoring it.
           size = 0;
           iByte += 1;
         }
-        else if ( status == 0xFE && ( data->ignoreFlags & 0x04 ) ) {
+        else if ( status == 0xFE && ( data->ignoreFlags.load( std::memory_order_relaxed ) & 0x04 ) ) {
           // A MIDI active sensing message and we're ignoring it.
           size = 0;
           iByte += 1;
         }
         else size = 1;
 
-        // Copy the MIDI data to our vector.
         if ( size ) {
           foundNonFiltered = true;
-          message.bytes.assign( &packet->data[iByte], &packet->data[iByte+size] );
           if ( !continueSysex ) {
-            // If not a continuing sysex message, invoke the user callback function or queue the message.
-            if ( data->usingCallback ) {
-              RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) data->userCallback;
-              callback( message.timeStamp, &message.bytes, data->userData );
-            }
-            else {
-              // As long as we haven't reached our queue size limit, push the message.
-              if ( !data->queue.push( message ) )
-                std::cerr << "\nMidiInCore: message queue limit reached!!\n\n";
-            }
-            message.bytes.clear();
+            // If not a continuing sysex message, invoke the user callback
+            // function or queue the message straight from the packet.
+            data->dispatch( &packet->data[iByte], size, message.timeStamp, timeStampNs );
+          }
+          else {
+            // Copy the start of the sysex to our vector.
+            message.bytes.assign( &packet->data[iByte], &packet->data[iByte+size] );
           }
           iByte += size;
         }
@@ -1427,8 +2100,6 @@ void MidiOutCore :: sendMessage( const unsigned char *message, size_t size )
   }
 
   MIDITimeStamp timeStamp = AudioGetCurrentHostTime();
-  CoreMidiData *data = static_cast<CoreMidiData *> (apiData_);
-  OSStatus result;
 
   if ( message[0] != 0xF0 && nBytes > 3 ) {
     errorString_ = "MidiOutCore::sendMessage: message format problem ... not sysex but > 3 bytes?";
@@ -1455,6 +2126,46 @@ void MidiOutCore :: sendMessage( const unsigned char *message, size_t size )
     return;
   }
 
+  sendPacketList( packetList );
+}
+
+void MidiOutCore :: sendMessages( const RtMidiOut::Message *messages, size_t count )
+{
+  // Consecutive short messages share one packet list, sysex messages
+  // are sent on their own by sendMessage().
+  std::vector<Byte> buffer( sizeof( MIDIPacketList ) + count * sizeof( MIDIPacket ) );
+  MIDIPacketList *packetList = (MIDIPacketList*)&buffer[0];
+  MIDIPacket *packet = MIDIPacketListInit( packetList );
+  MIDITimeStamp timeStamp = AudioGetCurrentHostTime();
+  size_t pending = 0;
+
+  for ( size_t i=0; i<count; ++i ) {
+    const RtMidiOut::Message &message = messages[i];
+    if ( message.size == 0 || message.size > 3 || message.bytes[0] == 0xF0 ) {
+      if ( pending > 0 ) sendPacketList( packetList );
+      packet = MIDIPacketListInit( packetList );
+      pending = 0;
+      sendMessage( message.bytes, message.size );
+      continue;
+    }
+
+    packet = MIDIPacketListAdd( packetList, buffer.size(), packet, timeStamp, message.size, (const Byte *) message.bytes );
+    if ( !packet ) {
+      errorString_ = "MidiOutCore::sendMessages: could not allocate packet list";
+      error( RtMidiError::DRIVER_ERROR, errorString_ );
+      return;
+    }
+    ++pending;
+  }
+
+  if ( pending > 0 ) sendPacketList( packetList );
+}
+
+void MidiOutCore :: sendPacketList( const MIDIPacketList *packetList )
+{
+  CoreMidiData *data = static_cast<CoreMidiData *> (apiData_);
+  OSStatus result;
+
   // Send to any destinations that may have connected to us.
   if ( data->endpoint ) {
     result = MIDIReceived( data->endpoint, packetList );
@@ -1497,7 +2208,13 @@ void MidiOutCore :: sendMessage( const unsigned char *message, size_t size )
 // associated with the ALSA sequencer queues.
 
 #include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include <sys/time.h>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <map>
 
 // ALSA header file.
 #include <alsa/asoundlib.h>
@@ -1514,46 +2231,152 @@ struct AlsaMidiData {
   unsigned char *buffer;
   pthread_t thread;
   pthread_t dummy_thread_id;
-  snd_seq_real_time_t lastTime;
+  unsigned long long lastTimeNs;
+  unsigned long long queueStartNs; // RtMidi::getTimeNs() when the input queue was started
   int queue_id; // an input queue is needed to get timestamped events
   int trigger_fds[2];
+  snd_seq_t *watchSeq; // client receiving the System:Announce events, see alsaPortWatchHandler()
+  pthread_t watchThread;
+  int watch_fds[2];
+  std::string clientName; // also names the watch client
 };
 
 #define PORT_TYPE( pinfo, bits ) ((snd_seq_port_info_get_capability(pinfo) & (bits)) == (bits))
 
+// mlockall() is process-wide, so every input asking for lockMemory
+// shares one lock, released by munlockall() when the last one lets go.
+static std::mutex alsaMemoryLockMutex;
+static int alsaMemoryLockCount = 0;
+
+// Takes a reference on the memory lock.  Returns 0 or the errno of mlockall().
+static int alsaLockMemory( void )
+{
+  std::lock_guard<std::mutex> lock( alsaMemoryLockMutex );
+  if ( alsaMemoryLockCount == 0 && mlockall( MCL_CURRENT | MCL_FUTURE ) != 0 )
+    return errno;
+  ++alsaMemoryLockCount;
+  return 0;
+}
+
+// Drops the reference taken for status, if any.
+static void alsaUnlockMemory( RtMidiIn::ThreadStatus &status )
+{
+  if ( !status.memoryLocked ) return;
+  status.memoryLocked = false;
+  std::lock_guard<std::mutex> lock( alsaMemoryLockMutex );
+  if ( --alsaMemoryLockCount == 0 )
+    munlockall();
+}
+
 //*********************************************************************//
 //  API: LINUX ALSA
 //  Class Definitions: MidiInAlsa
 //*********************************************************************//
 
-static void *alsaMidiHandler( void *ptr )
+// This is a bit weird, but we now have to decode an ALSA MIDI event
+// (back) into MIDI bytes.  We'll ignore non-MIDI types.  Returns the
+// size of the decoded message, held in buffer or in the sysex buffer of
+// data, or 0 if the event is ignored or is not a complete message yet.
+static size_t alsaDecodeEvent( MidiInApi::RtMidiInData *data, snd_midi_event_t *coder, snd_seq_event_t *ev,
+                               bool &continueSysex, unsigned char *buffer, long bufferSize,
+                               const unsigned char **messageBytes )
 {
-  MidiInApi::RtMidiInData *data = static_cast<MidiInApi::RtMidiInData *> (ptr);
-  AlsaMidiData *apiData = static_cast<AlsaMidiData *> (data->apiData);
-
-  long nBytes;
-  double time;
-  bool continueSysex = false;
   bool doDecode = false;
-  MidiInApi::MidiMessage message;
-  int poll_fd_count;
-  struct pollfd *poll_fds;
+  size_t messageSize = 0;
+  switch ( ev->type ) {
+
+  case SND_SEQ_EVENT_PORT_SUBSCRIBED:
+    RTMIDI_LOG_DEBUG( "alsaDecodeEvent: port connection made!\n" );
+    break;
+
+  case SND_SEQ_EVENT_PORT_UNSUBSCRIBED:
+    RTMIDI_LOG_DEBUG( "alsaDecodeEvent: port connection has closed!\n"
+                    << "sender = " << (int) ev->data.connect.sender.client << ":"
+                    << (int) ev->data.connect.sender.port
+                    << ", dest = " << (int) ev->data.connect.dest.client << ":"
+                    << (int) ev->data.connect.dest.port
+                    << "\n" );
+    break;
+
+  case SND_SEQ_EVENT_QFRAME: // MIDI time code
+    if ( !( data->ignoreFlags.load( std::memory_order_relaxed ) & 0x02 ) ) doDecode = true;
+    break;
+
+  case SND_SEQ_EVENT_TICK: // 0xF9 ... MIDI timing tick
+    if ( !( data->ignoreFlags.load( std::memory_order_relaxed ) & 0x02 ) ) doDecode = true;
+    break;
+
+  case SND_SEQ_EVENT_CLOCK: // 0xF8 ... MIDI timing (clock) tick
+    if ( !( data->ignoreFlags.load( std::memory_order_relaxed ) & 0x02 ) ) doDecode = true;
+    break;
+
+  case SND_SEQ_EVENT_SENSING: // Active sensing
+    if ( !( data->ignoreFlags.load( std::memory_order_relaxed ) & 0x04 ) ) doDecode = true;
+    break;
+
+  case SND_SEQ_EVENT_SYSEX:
+    if ( (data->ignoreFlags.load( std::memory_order_relaxed ) & 0x01) ) break;
+    doDecode = true;
+    break;
+
+  default:
+    doDecode = true;
+  }
 
-  snd_seq_event_t *ev;
+  if ( doDecode ) {
+
+    if ( ev->type == SND_SEQ_EVENT_SYSEX ) {
+      // The ALSA sequencer has a maximum buffer size for MIDI sysex
+      // events of 256 bytes.  If a device sends sysex messages larger
+      // than this, they are segmented into 256 byte chunks.  So,
+      // we'll watch for this and reassemble the chunks in the sysex
+      // buffer.  Sysex events hold the raw bytes, there is nothing
+      // to decode.
+      const unsigned char *chunk = (const unsigned char *) ev->data.ext.ptr;
+      unsigned int chunkSize = ev->data.ext.len;
+      if ( !continueSysex ) data->sysex.clear();
+      data->sysex.append( chunk, chunkSize );
+
+      continueSysex = chunkSize > 0 && chunk[chunkSize - 1] != 0xF7;
+      if ( !continueSysex && !data->sysex.overflow ) {
+        *messageBytes = data->sysex.bytes.data();
+        messageSize = data->sysex.size;
+      }
+    }
+    else {
+      long nBytes = snd_midi_event_decode( coder, buffer, bufferSize, ev );
+      if ( nBytes > 0 ) {
+        *messageBytes = buffer;
+        messageSize = nBytes;
+      }
+      else {
+        RTMIDI_LOG_DEBUG( "\nalsaDecodeEvent: event parsing error or not a MIDI event!\n\n" );
+      }
+    }
+  }
+
+  return messageSize;
+}
+
+static void *alsaMidiHandler( void *ptr )
+{
+  MidiInApi::RtMidiInData *data = static_cast<MidiInApi::RtMidiInData *> (ptr);
+  AlsaMidiData *apiData = static_cast<AlsaMidiData *> (data->apiData);
+
+  bool continueSysex = false;
+  double timeStamp = 0.0;
+  // Decode buffer for everything but sysex, which is reassembled in data->sysex.
+  unsigned char buffer[32];
+  MidiInApi::MessageBatch batch;
+  int poll_fd_count;
+  struct pollfd *poll_fds;
+
+  snd_seq_event_t *ev;
   int result;
-  apiData->bufferSize = 32;
   result = snd_midi_event_new( 0, &apiData->coder );
   if ( result < 0 ) {
     data->doInput = false;
-    std::cerr << "\nMidiInAlsa::alsaMidiHandler: error initializing MIDI event parser!\n\n";
-    return 0;
-  }
-  unsigned char *buffer = (unsigned char *) malloc( apiData->bufferSize );
-  if ( buffer == NULL ) {
-    data->doInput = false;
-    snd_midi_event_free( apiData->coder );
-    apiData->coder = 0;
-    std::cerr << "\nMidiInAlsa::alsaMidiHandler: error initializing buffer memory!\n\n";
+    RTMIDI_LOG_WARN( "\nMidiInAlsa::alsaMidiHandler: error initializing MIDI event parser!\n\n" );
     return 0;
   }
   snd_midi_event_init( apiData->coder );
@@ -1579,158 +2402,53 @@ static void *alsaMidiHandler( void *ptr )
       continue;
     }
 
-    // If here, there should be data.
-    result = snd_seq_event_input( apiData->seq, &ev );
-    if ( result == -ENOSPC ) {
-      std::cerr << "\nMidiInAlsa::alsaMidiHandler: MIDI input buffer overrun!\n\n";
-      continue;
-    }
-    else if ( result <= 0 ) {
-      std::cerr << "\nMidiInAlsa::alsaMidiHandler: unknown MIDI input error!\n";
-      perror("System reports");
-      continue;
-    }
-
-    // This is a bit weird, but we now have to decode an ALSA MIDI
-    // event (back) into MIDI bytes.  We'll ignore non-MIDI types.
-    if ( !continueSysex ) message.bytes.clear();
-
-    doDecode = false;
-    switch ( ev->type ) {
-
-    case SND_SEQ_EVENT_PORT_SUBSCRIBED:
-#if defined(__RTMIDI_DEBUG__)
-      std::cout << "MidiInAlsa::alsaMidiHandler: port connection made!\n";
-#endif
-      break;
-
-    case SND_SEQ_EVENT_PORT_UNSUBSCRIBED:
-#if defined(__RTMIDI_DEBUG__)
-      std::cerr << "MidiInAlsa::alsaMidiHandler: port connection has closed!\n";
-      std::cout << "sender = " << (int) ev->data.connect.sender.client << ":"
-                << (int) ev->data.connect.sender.port
-                << ", dest = " << (int) ev->data.connect.dest.client << ":"
-                << (int) ev->data.connect.dest.port
-                << std::endl;
-#endif
-      break;
-
-    case SND_SEQ_EVENT_QFRAME: // MIDI time code
-      if ( !( data->ignoreFlags & 0x02 ) ) doDecode = true;
-      break;
-
-    case SND_SEQ_EVENT_TICK: // 0xF9 ... MIDI timing tick
-      if ( !( data->ignoreFlags & 0x02 ) ) doDecode = true;
-      break;
-
-    case SND_SEQ_EVENT_CLOCK: // 0xF8 ... MIDI timing (clock) tick
-      if ( !( data->ignoreFlags & 0x02 ) ) doDecode = true;
-      break;
-
-    case SND_SEQ_EVENT_SENSING: // Active sensing
-      if ( !( data->ignoreFlags & 0x04 ) ) doDecode = true;
-      break;
-
-    case SND_SEQ_EVENT_SYSEX:
-      if ( (data->ignoreFlags & 0x01) ) break;
-      if ( ev->data.ext.len > apiData->bufferSize ) {
-        apiData->bufferSize = ev->data.ext.len;
-        free( buffer );
-        buffer = (unsigned char *) malloc( apiData->bufferSize );
-        if ( buffer == NULL ) {
-          data->doInput = false;
-          std::cerr << "\nMidiInAlsa::alsaMidiHandler: error resizing buffer memory!\n\n";
-          break;
-        }
+    // If here, there should be data.  Drain every event that was read
+    // from the sequencer along with this one before going back to poll(),
+    // and deliver the decoded messages together.
+    do {
+      result = snd_seq_event_input( apiData->seq, &ev );
+      if ( result == -ENOSPC ) {
+        RTMIDI_LOG_WARN( "\nMidiInAlsa::alsaMidiHandler: MIDI input buffer overrun!\n\n" );
+        continue;
+      }
+      else if ( result <= 0 ) {
+        RTMIDI_LOG_WARN( "\nMidiInAlsa::alsaMidiHandler: unknown MIDI input error!\n"
+                       << "System reports: " << strerror( errno ) << "\n" );
+        continue;
       }
-      doDecode = true;
-      break;
-
-    default:
-      doDecode = true;
-    }
 
-    if ( doDecode ) {
+      // Absolute timestamp: the event is stamped with the real time of
+      // our input queue (thanks to Pedro Lopez-Cabanillas!), which runs
+      // from the moment it was started.
+#ifndef AVOID_TIMESTAMPING
+      unsigned long long timeStampNs = apiData->queueStartNs +
+        (unsigned long long) ev->time.time.tv_sec * 1000000000ULL + ev->time.time.tv_nsec;
+#else
+      unsigned long long timeStampNs = RtMidi::getTimeNs();
+#endif
 
-      nBytes = snd_midi_event_decode( apiData->coder, buffer, apiData->bufferSize, ev );
-      if ( nBytes > 0 ) {
-        // The ALSA sequencer has a maximum buffer size for MIDI sysex
-        // events of 256 bytes.  If a device sends sysex messages larger
-        // than this, they are segmented into 256 byte chunks.  So,
-        // we'll watch for this and concatenate sysex chunks into a
-        // single sysex message if necessary.
-        if ( !continueSysex )
-          message.bytes.assign( buffer, &buffer[nBytes] );
+      const unsigned char *messageBytes = 0;
+      size_t messageSize = alsaDecodeEvent( data, apiData->coder, ev, continueSysex, buffer, sizeof( buffer ), &messageBytes );
+      if ( messageSize > 0 ) {
+        // Calculate the time stamp, from the absolute timestamps in
+        // integer nanoseconds so that no rounding error accumulates.
+        timeStamp = 0.0;
+        if ( data->firstMessage == true )
+          data->firstMessage = false;
         else
-          message.bytes.insert( message.bytes.end(), buffer, &buffer[nBytes] );
-
-        continueSysex = ( ( ev->type == SND_SEQ_EVENT_SYSEX ) && ( message.bytes.back() != 0xF7 ) );
-        if ( !continueSysex ) {
-
-          // Calculate the time stamp:
-          message.timeStamp = 0.0;
-
-          // Method 1: Use the system time.
-          //(void)gettimeofday(&tv, (struct timezone *)NULL);
-          //time = (tv.tv_sec * 1000000) + tv.tv_usec;
-
-          // Method 2: Use the ALSA sequencer event time data.
-          // (thanks to Pedro Lopez-Cabanillas!).
-
-          // Using method from:
-          // https://www.gnu.org/software/libc/manual/html_node/Elapsed-Time.html
-
-          // Perform the carry for the later subtraction by updating y.
-          // Temp var y is timespec because computation requires signed types,
-          // while snd_seq_real_time_t has unsigned types.
-          snd_seq_real_time_t &x( ev->time.time );
-          struct timespec y;
-          y.tv_nsec = apiData->lastTime.tv_nsec;
-          y.tv_sec = apiData->lastTime.tv_sec;
-          if ( x.tv_nsec < y.tv_nsec ) {
-              int nsec = (y.tv_nsec - (int)x.tv_nsec) / 1000000000 + 1;
-              y.tv_nsec -= 1000000000 * nsec;
-              y.tv_sec += nsec;
-          }
-          if ( x.tv_nsec - y.tv_nsec > 1000000000 ) {
-              int nsec = ((int)x.tv_nsec - y.tv_nsec) / 1000000000;
-              y.tv_nsec += 1000000000 * nsec;
-              y.tv_sec -= nsec;
-          }
-
-          // Compute the time difference.
-          time = (int)x.tv_sec - y.tv_sec + ((int)x.tv_nsec - y.tv_nsec)*1e-9;
-
-          apiData->lastTime = ev->time.time;
-
-          if ( data->firstMessage == true )
-            data->firstMessage = false;
-          else
-            message.timeStamp = time;
-        }
-        else {
-#if defined(__RTMIDI_DEBUG__)
-          std::cerr << "\nMidiInAlsa::alsaMidiHandler: event parsing error or not a MIDI event!\n\n";
-#endif
-        }
+          timeStamp = ( timeStampNs - apiData->lastTimeNs ) * 0.000000001;
+        apiData->lastTimeNs = timeStampNs;
       }
-    }
 
-    snd_seq_free_event( ev );
-    if ( message.bytes.size() == 0 || continueSysex ) continue;
+      snd_seq_free_event( ev );
+      if ( messageSize == 0 ) continue;
 
-    if ( data->usingCallback ) {
-      RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) data->userCallback;
-      callback( message.timeStamp, &message.bytes, data->userData );
-    }
-    else {
-      // As long as we haven't reached our queue size limit, push the message.
-      if ( !data->queue.push( message ) )
-        std::cerr << "\nMidiInAlsa: message queue limit reached!!\n\n";
-    }
+      data->addToBatch( batch, messageBytes, messageSize, timeStamp, timeStampNs );
+    } while ( data->doInput && snd_seq_event_input_pending( apiData->seq, 0 ) > 0 );
+
+    data->dispatch( batch );
   }
 
-  if ( buffer ) free( buffer );
   snd_midi_event_free( apiData->coder );
   apiData->coder = 0;
   apiData->thread = apiData->dummy_thread_id;
@@ -1758,6 +2476,9 @@ MidiInAlsa :: ~MidiInAlsa()
       pthread_join( data->thread, NULL );
   }
 
+  stopPortWatch();
+  alsaUnlockMemory( threadStatus_ );
+
   // Cleanup.
   close ( data->trigger_fds[0] );
   close ( data->trigger_fds[1] );
@@ -1793,6 +2514,11 @@ void MidiInAlsa :: initialize( const std::string& clientName )
   data->thread = data->dummy_thread_id;
   data->trigger_fds[0] = -1;
   data->trigger_fds[1] = -1;
+  data->lastTimeNs = 0;
+  data->queueStartNs = 0;
+  data->watchSeq = 0;
+  data->watch_fds[0] = -1;
+  data->watch_fds[1] = -1;
   apiData_ = (void *) data;
   inputData_.apiData = (void *) data;
 
@@ -1802,6 +2528,9 @@ void MidiInAlsa :: initialize( const std::string& clientName )
     return;
   }
 
+  data->clientName = clientName;
+  applyEventFilter();
+
   // Create the input queue
 #ifndef AVOID_TIMESTAMPING
   data->queue_id = snd_seq_alloc_named_queue( seq, "RtMidi Queue" );
@@ -1815,6 +2544,85 @@ void MidiInAlsa :: initialize( const std::string& clientName )
 #endif
 }
 
+void MidiInAlsa :: ignoreTypes( bool midiSysex, bool midiTime, bool midiSense )
+{
+  MidiInApi::ignoreTypes( midiSysex, midiTime, midiSense );
+  applyEventFilter();
+}
+
+void MidiInAlsa :: acceptChannelMessages( unsigned int kinds )
+{
+  MidiInApi::acceptChannelMessages( kinds );
+  applyEventFilter();
+}
+
+// Sets the event filter of a sequencer client to the events wanted with
+// these ignoreTypes() flags and acceptChannelMessages() kinds.
+static bool alsaSetEventFilter( snd_seq_t *seq, unsigned char ignoreFlags, unsigned char channelKinds )
+{
+  static const struct { int type; unsigned char kind; } channelEvents[] = {
+    { SND_SEQ_EVENT_NOTEOFF, RtMidiIn::NOTE_OFF },
+    { SND_SEQ_EVENT_NOTEON, RtMidiIn::NOTE_ON },
+    { SND_SEQ_EVENT_NOTE, RtMidiIn::NOTE_ON },
+    { SND_SEQ_EVENT_KEYPRESS, RtMidiIn::POLY_PRESSURE },
+    { SND_SEQ_EVENT_CONTROLLER, RtMidiIn::CONTROL_CHANGE },
+    { SND_SEQ_EVENT_CONTROL14, RtMidiIn::CONTROL_CHANGE },
+    { SND_SEQ_EVENT_NONREGPARAM, RtMidiIn::CONTROL_CHANGE },
+    { SND_SEQ_EVENT_REGPARAM, RtMidiIn::CONTROL_CHANGE },
+    { SND_SEQ_EVENT_PGMCHANGE, RtMidiIn::PROGRAM_CHANGE },
+    { SND_SEQ_EVENT_CHANPRESS, RtMidiIn::CHANNEL_PRESSURE },
+    { SND_SEQ_EVENT_PITCHBEND, RtMidiIn::PITCH_BEND }
+  };
+  // Always decoded, and the connection notifications.
+  static const int otherEvents[] = {
+    SND_SEQ_EVENT_SONGPOS, SND_SEQ_EVENT_SONGSEL, SND_SEQ_EVENT_TUNE_REQUEST,
+    SND_SEQ_EVENT_START, SND_SEQ_EVENT_CONTINUE, SND_SEQ_EVENT_STOP, SND_SEQ_EVENT_RESET,
+    SND_SEQ_EVENT_PORT_SUBSCRIBED, SND_SEQ_EVENT_PORT_UNSUBSCRIBED
+  };
+
+  snd_seq_client_info_t *info;
+  snd_seq_client_info_alloca( &info );
+  if ( snd_seq_get_client_info( seq, info ) < 0 ) return false;
+
+  // Without anything to ignore, no filter at all lets every event through.
+  snd_seq_client_info_event_filter_clear( info );
+  if ( ignoreFlags != 0 || channelKinds != RtMidiIn::ALL_CHANNEL_MESSAGES ) {
+    for ( size_t i=0; i<sizeof( channelEvents ) / sizeof( channelEvents[0] ); ++i ) {
+      if ( channelKinds & channelEvents[i].kind )
+        snd_seq_client_info_event_filter_add( info, channelEvents[i].type );
+    }
+    for ( size_t i=0; i<sizeof( otherEvents ) / sizeof( otherEvents[0] ); ++i )
+      snd_seq_client_info_event_filter_add( info, otherEvents[i] );
+    if ( !( ignoreFlags & 0x01 ) ) {
+      snd_seq_client_info_event_filter_add( info, SND_SEQ_EVENT_SYSEX );
+    }
+    if ( !( ignoreFlags & 0x02 ) ) {
+      snd_seq_client_info_event_filter_add( info, SND_SEQ_EVENT_QFRAME );
+      snd_seq_client_info_event_filter_add( info, SND_SEQ_EVENT_CLOCK );
+      snd_seq_client_info_event_filter_add( info, SND_SEQ_EVENT_TICK );
+    }
+    if ( !( ignoreFlags & 0x04 ) ) {
+      snd_seq_client_info_event_filter_add( info, SND_SEQ_EVENT_SENSING );
+    }
+  }
+
+  return snd_seq_set_client_info( seq, info ) >= 0;
+}
+
+// Installs the ignoreTypes() and acceptChannelMessages() settings as the
+// client event filter, so that the sequencer does not even deliver the
+// events alsaMidiHandler() would drop.
+void MidiInAlsa :: applyEventFilter( void )
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  if ( data == 0 ) return;
+
+  if ( !alsaSetEventFilter( data->seq, inputData_.ignoreFlags.load( std::memory_order_relaxed ), inputData_.channelKinds.load( std::memory_order_relaxed ) ) ) {
+    errorString_ = "MidiInAlsa::applyEventFilter: error setting the client event filter, ignored events are dropped on input.";
+    error( RtMidiError::WARNING, errorString_ );
+  }
+}
+
 // This function is used to count or get the pinfo structure for a given port number.
 unsigned int portInfo( snd_seq_t *seq, snd_seq_port_info_t *pinfo, unsigned int type, int portNumber )
 {
@@ -1848,8 +2656,170 @@ unsigned int portInfo( snd_seq_t *seq, snd_seq_port_info_t *pinfo, unsigned int
   return 0;
 }
 
+// Returns the name of the port described by pinfo, as listed by getPortName().
+static std::string alsaPortName( snd_seq_t *seq, snd_seq_port_info_t *pinfo )
+{
+  snd_seq_client_info_t *cinfo;
+  snd_seq_client_info_alloca( &cinfo );
+
+  int cnum = snd_seq_port_info_get_client( pinfo );
+  snd_seq_get_any_client_info( seq, cnum, cinfo );
+  std::ostringstream os;
+  os << snd_seq_client_info_get_name( cinfo );
+  os << ":";
+  os << snd_seq_port_info_get_name( pinfo );
+  os << " ";                                    // These lines added to make sure devices are listed
+  os << snd_seq_port_info_get_client( pinfo );  // with full portnames added to ensure individual device names
+  os << ":";
+  os << snd_seq_port_info_get_port( pinfo );
+  return os.str();
+}
+
+// Lists the names of all the input ports, in port number order.
+static void alsaInputPortNames( snd_seq_t *seq, std::vector<std::string> &names )
+{
+  snd_seq_port_info_t *pinfo;
+  snd_seq_port_info_alloca( &pinfo );
+
+  names.clear();
+  int nPorts = portInfo( seq, pinfo, SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ, -1 );
+  for ( int i=0; i<nPorts; ++i ) {
+    if ( portInfo( seq, pinfo, SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ, i ) )
+      names.push_back( alsaPortName( seq, pinfo ) );
+  }
+}
+
+// Keeps the port list cache of the input data up to date: waits for the
+// System:Announce events and enumerates the ports again when a client or
+// a port appeared, went away or changed.
+static void *alsaPortWatchHandler( void *ptr )
+{
+  MidiInApi::RtMidiInData *data = static_cast<MidiInApi::RtMidiInData *> (ptr);
+  AlsaMidiData *apiData = static_cast<AlsaMidiData *> (data->apiData);
+
+  int poll_fd_count = snd_seq_poll_descriptors_count( apiData->watchSeq, POLLIN ) + 1;
+  struct pollfd *poll_fds = (struct pollfd*)alloca( poll_fd_count * sizeof( struct pollfd ));
+  snd_seq_poll_descriptors( apiData->watchSeq, poll_fds + 1, poll_fd_count - 1, POLLIN );
+  poll_fds[0].fd = apiData->watch_fds[0];
+  poll_fds[0].events = POLLIN;
+
+  std::vector<std::string> names;
+  while ( true ) {
+    if ( poll( poll_fds, poll_fd_count, -1 ) < 0 ) continue;
+    if ( poll_fds[0].revents & POLLIN ) break; // stopPortWatch()
+
+    bool changed = false;
+    snd_seq_event_t *ev;
+    int result;
+    while ( ( result = snd_seq_event_input( apiData->watchSeq, &ev ) ) >= 0 || result == -ENOSPC ) {
+      // Events were lost on overrun, assume they mattered.
+      if ( result == -ENOSPC ) {
+        changed = true;
+        continue;
+      }
+      switch ( ev->type ) {
+      case SND_SEQ_EVENT_CLIENT_START:
+      case SND_SEQ_EVENT_CLIENT_EXIT:
+      case SND_SEQ_EVENT_CLIENT_CHANGE:
+      case SND_SEQ_EVENT_PORT_START:
+      case SND_SEQ_EVENT_PORT_EXIT:
+      case SND_SEQ_EVENT_PORT_CHANGE:
+        changed = true;
+        break;
+      default:
+        break;
+      }
+      snd_seq_free_event( ev );
+    }
+
+    if ( changed ) {
+      alsaInputPortNames( apiData->watchSeq, names );
+      data->portList.update( names );
+    }
+  }
+
+  return 0;
+}
+
+// Starts the port list cache: a second sequencer client, subscribed to
+// System:Announce, whose thread only wakes up when the ports change.
+// On failure, the ports are enumerated on each query instead.
+void MidiInAlsa :: watchPortList( void )
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  if ( data && !data->watchSeq ) startPortWatch();
+}
+
+void MidiInAlsa :: startPortWatch( void )
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+
+  if ( snd_seq_open( &data->watchSeq, "default", SND_SEQ_OPEN_INPUT, SND_SEQ_NONBLOCK ) < 0 ) {
+    data->watchSeq = 0;
+    errorString_ = "MidiInAlsa::startPortWatch: error creating ALSA sequencer client object, port changes will not be notified.";
+    error( RtMidiError::WARNING, errorString_ );
+    return;
+  }
+  snd_seq_set_client_name( data->watchSeq, data->clientName.c_str() );
+
+  int port = snd_seq_create_simple_port( data->watchSeq, "RtMidi Port Watch",
+                                         SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_NO_EXPORT,
+                                         SND_SEQ_PORT_TYPE_APPLICATION );
+  if ( port < 0 ||
+       snd_seq_connect_from( data->watchSeq, port, SND_SEQ_CLIENT_SYSTEM, SND_SEQ_PORT_SYSTEM_ANNOUNCE ) < 0 ||
+       pipe( data->watch_fds ) == -1 ) {
+    snd_seq_close( data->watchSeq );
+    data->watchSeq = 0;
+    errorString_ = "MidiInAlsa::startPortWatch: error subscribing to the ALSA announce port, port changes will not be notified.";
+    error( RtMidiError::WARNING, errorString_ );
+    return;
+  }
+
+  // Fill the cache before the thread starts, no event can be missed
+  // since we are already subscribed.
+  std::vector<std::string> names;
+  alsaInputPortNames( data->watchSeq, names );
+  inputData_.portList.update( names );
+
+  if ( pthread_create( &data->watchThread, NULL, alsaPortWatchHandler, &inputData_ ) ) {
+    close( data->watch_fds[0] );
+    close( data->watch_fds[1] );
+    data->watch_fds[0] = -1;
+    data->watch_fds[1] = -1;
+    snd_seq_close( data->watchSeq );
+    data->watchSeq = 0;
+    errorString_ = "MidiInAlsa::startPortWatch: error starting the port watch thread, port changes will not be notified.";
+    error( RtMidiError::WARNING, errorString_ );
+    return;
+  }
+
+  inputData_.portList.enabled = true;
+}
+
+void MidiInAlsa :: stopPortWatch( void )
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  if ( !data->watchSeq ) return;
+
+  inputData_.portList.enabled = false;
+  if ( data->watch_fds[1] >= 0 ) {
+    bool stop = true;
+    int res = write( data->watch_fds[1], &stop, sizeof( stop ) );
+    (void) res;
+    pthread_join( data->watchThread, NULL );
+    close( data->watch_fds[0] );
+    close( data->watch_fds[1] );
+    data->watch_fds[0] = -1;
+    data->watch_fds[1] = -1;
+  }
+  snd_seq_close( data->watchSeq );
+  data->watchSeq = 0;
+}
+
 unsigned int MidiInAlsa :: getPortCount()
 {
+  if ( inputData_.portList.enabled ) return inputData_.portList.count();
+
   snd_seq_port_info_t *pinfo;
   snd_seq_port_info_alloca( &pinfo );
 
@@ -1859,25 +2829,16 @@ unsigned int MidiInAlsa :: getPortCount()
 
 std::string MidiInAlsa :: getPortName( unsigned int portNumber )
 {
-  snd_seq_client_info_t *cinfo;
+  std::string stringName;
+  if ( inputData_.portList.enabled && inputData_.portList.name( portNumber, stringName ) )
+    return stringName;
+
   snd_seq_port_info_t *pinfo;
-  snd_seq_client_info_alloca( &cinfo );
   snd_seq_port_info_alloca( &pinfo );
 
-  std::string stringName;
   AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
   if ( portInfo( data->seq, pinfo, SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ, (int) portNumber ) ) {
-    int cnum = snd_seq_port_info_get_client( pinfo );
-    snd_seq_get_any_client_info( data->seq, cnum, cinfo );
-    std::ostringstream os;
-    os << snd_seq_client_info_get_name( cinfo );
-    os << ":";
-    os << snd_seq_port_info_get_name( pinfo );
-    os << " ";                                    // These lines added to make sure devices are listed
-    os << snd_seq_port_info_get_client( pinfo );  // with full portnames added to ensure individual device names
-    os << ":";
-    os << snd_seq_port_info_get_port( pinfo );
-    stringName = os.str();
+    stringName = alsaPortName( data->seq, pinfo );
     return stringName;
   }
 
@@ -1971,6 +2932,7 @@ void MidiInAlsa :: openPort( unsigned int portNumber, const std::string &portNam
 #ifndef AVOID_TIMESTAMPING
     snd_seq_start_queue( data->seq, data->queue_id, NULL );
     snd_seq_drain_output( data->seq );
+    data->queueStartNs = RtMidi::getTimeNs();
 #endif
     // Start our MIDI input thread.
     pthread_attr_t attr;
@@ -1990,6 +2952,7 @@ void MidiInAlsa :: openPort( unsigned int portNumber, const std::string &portNam
       error( RtMidiError::THREAD_ERROR, errorString_ );
       return;
     }
+    applyThreadOptions();
   }
 
   connected_ = true;
@@ -2033,6 +2996,7 @@ void MidiInAlsa :: openVirtualPort( const std::string &portName )
 #ifndef AVOID_TIMESTAMPING
     snd_seq_start_queue( data->seq, data->queue_id, NULL );
     snd_seq_drain_output( data->seq );
+    data->queueStartNs = RtMidi::getTimeNs();
 #endif
     // Start our MIDI input thread.
     pthread_attr_t attr;
@@ -2054,6 +3018,93 @@ void MidiInAlsa :: openVirtualPort( const std::string &portName )
       error( RtMidiError::THREAD_ERROR, errorString_ );
       return;
     }
+    applyThreadOptions();
+  }
+}
+
+void MidiInAlsa :: setThreadOptions( const RtMidiIn::ThreadOptions &options )
+{
+  threadOptions_ = options;
+  if ( inputData_.doInput ) applyThreadOptions();
+}
+
+// Applies the requested options to an input thread and records what
+// was achieved in status.  Each option is tried on its own, so that a
+// missing privilege for one of them (usually RLIMIT_RTPRIO or
+// RLIMIT_MEMLOCK) does not prevent the others.  Failures are returned in
+// warnings, prefixed with the caller name.
+static void alsaApplyThreadOptions( pthread_t thread, const RtMidiIn::ThreadOptions &options,
+                                    RtMidiIn::ThreadStatus &status, const char *caller,
+                                    std::vector<std::string> &warnings )
+{
+  int policy = SCHED_OTHER;
+  if ( options.policy == RtMidiIn::THREAD_POLICY_FIFO ) policy = SCHED_FIFO;
+  else if ( options.policy == RtMidiIn::THREAD_POLICY_RR ) policy = SCHED_RR;
+
+  struct sched_param param;
+  param.sched_priority = 0;
+  if ( policy != SCHED_OTHER ) {
+    int minPriority = sched_get_priority_min( policy );
+    int maxPriority = sched_get_priority_max( policy );
+    param.sched_priority = std::min( std::max( options.priority, minPriority ), maxPriority );
+  }
+
+  int err = pthread_setschedparam( thread, policy, &param );
+  if ( err == 0 ) {
+    status.policy = options.policy;
+    status.priority = param.sched_priority;
+  }
+  else {
+    status.policy = RtMidiIn::THREAD_POLICY_DEFAULT;
+    status.priority = 0;
+    std::ostringstream ost;
+    ost << caller << ": could not set the real-time scheduling policy (" << strerror( err ) << ").";
+    warnings.push_back( ost.str() );
+  }
+
+  status.cpu = -1;
+  if ( options.cpu >= CPU_SETSIZE ) {
+    std::ostringstream ost;
+    ost << caller << ": CPU " << options.cpu << " is out of range (at most " << CPU_SETSIZE - 1 << "), the input thread is not pinned.";
+    warnings.push_back( ost.str() );
+  }
+  else if ( options.cpu >= 0 ) {
+    cpu_set_t cpus;
+    CPU_ZERO( &cpus );
+    CPU_SET( options.cpu, &cpus );
+    err = pthread_setaffinity_np( thread, sizeof(cpus), &cpus );
+    if ( err == 0 )
+      status.cpu = options.cpu;
+    else {
+      std::ostringstream ost;
+      ost << caller << ": could not pin the input thread to CPU " << options.cpu << " (" << strerror( err ) << ").";
+      warnings.push_back( ost.str() );
+    }
+  }
+
+  if ( options.lockMemory && !status.memoryLocked ) {
+    err = alsaLockMemory();
+    if ( err == 0 )
+      status.memoryLocked = true;
+    else {
+      std::ostringstream ost;
+      ost << caller << ": could not lock memory (" << strerror( err ) << ").";
+      warnings.push_back( ost.str() );
+    }
+  }
+  else if ( !options.lockMemory )
+    alsaUnlockMemory( status );
+}
+
+// Applies threadOptions_ to the running input thread.
+void MidiInAlsa :: applyThreadOptions( void )
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  std::vector<std::string> warnings;
+  alsaApplyThreadOptions( data->thread, threadOptions_, threadStatus_, "MidiInAlsa::applyThreadOptions", warnings );
+  for ( size_t i=0; i<warnings.size(); ++i ) {
+    errorString_ = warnings[i];
+    error( RtMidiError::WARNING, errorString_ );
   }
 }
 
@@ -2105,51 +3156,543 @@ void MidiInAlsa :: setPortName( const std::string &portName )
 
 //*********************************************************************//
 //  API: LINUX ALSA
-//  Class Definitions: MidiOutAlsa
+//  Class Definitions: MidiInAlsaShared
 //*********************************************************************//
 
-MidiOutAlsa :: MidiOutAlsa( const std::string &clientName ) : MidiOutApi()
+// The sequencer client shared by every MidiInAlsaShared instance: one
+// input port, subscribed to all the opened sources, and one thread
+// handing each event to the instance owning its source address.
+struct AlsaSharedClient {
+  snd_seq_t *seq;
+  int vport;
+  int queue_id;
+  unsigned long long queueStartNs;
+  snd_midi_event_t *coder;
+  pthread_t thread;
+  int trigger_fds[2];
+  bool running;
+  // Guards sources, pending, dispatching and the instances' input state.
+  // Once closePort() removed its source, an instance receives nothing
+  // anymore.
+  std::mutex mutex;
+  std::map<int, MidiInApi::RtMidiInData *> sources; // by client << 8 | port
+  // Instances with a batch to dispatch during the current wakeup, null
+  // once closed, and the one whose batch is being dispatched.
+  std::vector<MidiInApi::RtMidiInData *> pending;
+  MidiInApi::RtMidiInData *dispatching;
+  std::condition_variable dispatched; // signaled when dispatching changes
+  unsigned int users;
+};
+
+// Per instance data.
+struct AlsaSharedData {
+  AlsaSharedClient *client;
+  snd_seq_addr_t source;
+  snd_seq_port_subscribe_t *subscription;
+  unsigned long long lastTimeNs;
+  bool continueSysex;
+  MidiInApi::MessageBatch batch;
+};
+
+static std::mutex alsaSharedMutex; // guards alsaShared
+static AlsaSharedClient *alsaShared = 0;
+
+static int alsaSourceKey( const snd_seq_addr_t &address )
 {
-  MidiOutAlsa::initialize( clientName );
+  return ( address.client << 8 ) | address.port;
 }
 
-MidiOutAlsa :: ~MidiOutAlsa()
+static void *alsaSharedHandler( void *ptr )
 {
-  // Close a connection if it exists.
-  MidiOutAlsa::closePort();
+  AlsaSharedClient *client = static_cast<AlsaSharedClient *> (ptr);
 
-  // Cleanup.
-  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
-  if ( data->vport >= 0 ) snd_seq_delete_port( data->seq, data->vport );
-  if ( data->coder ) snd_midi_event_free( data->coder );
-  if ( data->buffer ) free( data->buffer );
-  snd_seq_close( data->seq );
-  delete data;
-}
+  unsigned char buffer[32];
+  int poll_fd_count = snd_seq_poll_descriptors_count( client->seq, POLLIN ) + 1;
+  struct pollfd *poll_fds = (struct pollfd*)alloca( poll_fd_count * sizeof( struct pollfd ));
+  snd_seq_poll_descriptors( client->seq, poll_fds + 1, poll_fd_count - 1, POLLIN );
+  poll_fds[0].fd = client->trigger_fds[0];
+  poll_fds[0].events = POLLIN;
 
-void MidiOutAlsa :: initialize( const std::string& clientName )
-{
-  // Set up the ALSA sequencer client.
-  snd_seq_t *seq;
-  int result1 = snd_seq_open( &seq, "default", SND_SEQ_OPEN_OUTPUT, SND_SEQ_NONBLOCK );
-  if ( result1 < 0 ) {
-    errorString_ = "MidiOutAlsa::initialize: error creating ALSA sequencer client object.";
-    error( RtMidiError::DRIVER_ERROR, errorString_ );
-    return;
-  }
+  while ( client->running ) {
 
-  // Set client name.
-  snd_seq_set_client_name( seq, clientName.c_str() );
+    if ( snd_seq_event_input_pending( client->seq, 1 ) == 0 ) {
+      if ( poll( poll_fds, poll_fd_count, -1) >= 0 ) {
+        if ( poll_fds[0].revents & POLLIN ) {
+          bool dummy;
+          int res = read( poll_fds[0].fd, &dummy, sizeof(dummy) );
+          (void) res;
+        }
+      }
+      continue;
+    }
 
-  // Save our api-specific connection information.
-  AlsaMidiData *data = (AlsaMidiData *) new AlsaMidiData;
-  data->seq = seq;
-  data->portNum = -1;
-  data->vport = -1;
-  data->bufferSize = 32;
-  data->coder = 0;
-  data->buffer = 0;
-  int result = snd_midi_event_new( data->bufferSize, &data->coder );
+    // Events are decoded with the client locked and dispatched unlocked.
+    // A message that does not fit in the batch of its instance ends the
+    // decoding, it is dispatched after that batch.
+    MidiInApi::RtMidiInData *overflowData = 0;
+    const unsigned char *overflowBytes = 0;
+    size_t overflowSize = 0;
+    double overflowDeltaTime = 0.0;
+    unsigned long long overflowTimeStamp = 0;
+    std::unique_lock<std::mutex> lock( client->mutex );
+    do {
+      snd_seq_event_t *ev;
+      int result = snd_seq_event_input( client->seq, &ev );
+      if ( result == -ENOSPC ) {
+        RTMIDI_LOG_WARN( "\nMidiInAlsaShared::alsaSharedHandler: MIDI input buffer overrun!\n\n" );
+        continue;
+      }
+      else if ( result <= 0 ) {
+        RTMIDI_LOG_WARN( "\nMidiInAlsaShared::alsaSharedHandler: unknown MIDI input error!\n"
+                       << "System reports: " << strerror( errno ) << "\n" );
+        continue;
+      }
+
+      // Events of a source closed in the meantime are dropped.
+      std::map<int, MidiInApi::RtMidiInData *>::iterator it = client->sources.find( alsaSourceKey( ev->source ) );
+      if ( it == client->sources.end() ) {
+        snd_seq_free_event( ev );
+        continue;
+      }
+      MidiInApi::RtMidiInData *data = it->second;
+      AlsaSharedData *apiData = static_cast<AlsaSharedData *> (data->apiData);
+
+#ifndef AVOID_TIMESTAMPING
+      unsigned long long timeStampNs = client->queueStartNs +
+        (unsigned long long) ev->time.time.tv_sec * 1000000000ULL + ev->time.time.tv_nsec;
+#else
+      unsigned long long timeStampNs = RtMidi::getTimeNs();
+#endif
+
+      const unsigned char *messageBytes = 0;
+      size_t messageSize = alsaDecodeEvent( data, client->coder, ev, apiData->continueSysex, buffer, sizeof( buffer ), &messageBytes );
+      double timeStamp = 0.0;
+      if ( messageSize > 0 ) {
+        if ( data->firstMessage == true )
+          data->firstMessage = false;
+        else
+          timeStamp = ( timeStampNs - apiData->lastTimeNs ) * 0.000000001;
+        apiData->lastTimeNs = timeStampNs;
+      }
+
+      snd_seq_free_event( ev );
+      if ( messageSize == 0 || !data->accepts( messageBytes ) ) continue;
+
+      if ( apiData->batch.count == 0 ) client->pending.push_back( data );
+      if ( !apiData->batch.add( messageBytes, messageSize, timeStamp, timeStampNs ) ) {
+        overflowData = data;
+        overflowBytes = messageBytes;
+        overflowSize = messageSize;
+        overflowDeltaTime = timeStamp;
+        overflowTimeStamp = timeStampNs;
+        break;
+      }
+    } while ( client->running && snd_seq_event_input_pending( client->seq, 0 ) > 0 );
+
+    size_t next = 0;
+    for ( ;; ) {
+      MidiInApi::RtMidiInData *data = 0;
+      client->dispatching = 0;
+      while ( next < client->pending.size() && !client->pending[next] ) ++next;
+      if ( next < client->pending.size() ) data = client->dispatching = client->pending[next++];
+      else client->pending.clear();
+      lock.unlock();
+      client->dispatched.notify_all();
+      if ( !data ) break;
+
+      MidiInApi::MessageBatch &batch = static_cast<AlsaSharedData *> (data->apiData)->batch;
+      data->dispatch( batch );
+      if ( data == overflowData ) {
+        data->addToBatch( batch, overflowBytes, overflowSize, overflowDeltaTime, overflowTimeStamp );
+        data->dispatch( batch );
+      }
+      lock.lock();
+    }
+  }
+
+  return 0;
+}
+
+// Sets the client event filter to the events wanted by at least one of
+// the open instances, each one still drops the others on input.  Must be
+// called with the client mutex held.
+static bool alsaSharedSetEventFilter( AlsaSharedClient *client )
+{
+  unsigned char ignoreFlags = 0x07;
+  unsigned char channelKinds = 0;
+  std::map<int, MidiInApi::RtMidiInData *>::iterator it;
+  for ( it = client->sources.begin(); it != client->sources.end(); ++it ) {
+    ignoreFlags &= it->second->ignoreFlags.load( std::memory_order_relaxed );
+    channelKinds |= it->second->channelKinds.load( std::memory_order_relaxed );
+  }
+
+  return alsaSetEventFilter( client->seq, ignoreFlags, channelKinds );
+}
+
+// Returns the shared client, creating it for the first user.
+static AlsaSharedClient *alsaSharedAcquire( const std::string &clientName, std::string &errorText )
+{
+  std::lock_guard<std::mutex> lock( alsaSharedMutex );
+  if ( alsaShared ) {
+    ++alsaShared->users;
+    return alsaShared;
+  }
+
+  AlsaSharedClient *client = new AlsaSharedClient;
+  client->users = 1;
+  client->running = false;
+  client->dispatching = 0;
+  client->coder = 0;
+  client->trigger_fds[0] = -1;
+  client->trigger_fds[1] = -1;
+  if ( snd_seq_open( &client->seq, "default", SND_SEQ_OPEN_DUPLEX, SND_SEQ_NONBLOCK ) < 0 ) {
+    errorText = "MidiInAlsaShared::initialize: error creating ALSA sequencer client object.";
+    delete client;
+    return 0;
+  }
+  snd_seq_set_client_name( client->seq, clientName.c_str() );
+
+  snd_seq_port_info_t *pinfo;
+  snd_seq_port_info_alloca( &pinfo );
+  snd_seq_port_info_set_capability( pinfo, SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE );
+  snd_seq_port_info_set_type( pinfo, SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION );
+  snd_seq_port_info_set_midi_channels( pinfo, 16 );
+#ifndef AVOID_TIMESTAMPING
+  client->queue_id = snd_seq_alloc_named_queue( client->seq, "RtMidi Queue" );
+  snd_seq_port_info_set_timestamping( pinfo, 1 );
+  snd_seq_port_info_set_timestamp_real( pinfo, 1 );
+  snd_seq_port_info_set_timestamp_queue( pinfo, client->queue_id );
+#endif
+  snd_seq_port_info_set_name( pinfo, "RtMidi Shared Input" );
+
+  if ( snd_seq_create_port( client->seq, pinfo ) < 0 ||
+       snd_midi_event_new( 0, &client->coder ) < 0 ||
+       pipe( client->trigger_fds ) == -1 ) {
+    errorText = "MidiInAlsaShared::initialize: error creating the shared ALSA input port.";
+    if ( client->coder ) snd_midi_event_free( client->coder );
+    snd_seq_close( client->seq );
+    delete client;
+    return 0;
+  }
+  client->vport = snd_seq_port_info_get_port( pinfo );
+  snd_midi_event_init( client->coder );
+  snd_midi_event_no_status( client->coder, 1 ); // suppress running status messages
+
+#ifndef AVOID_TIMESTAMPING
+  snd_seq_start_queue( client->seq, client->queue_id, NULL );
+  snd_seq_drain_output( client->seq );
+  client->queueStartNs = RtMidi::getTimeNs();
+#endif
+
+  client->running = true;
+  if ( pthread_create( &client->thread, NULL, alsaSharedHandler, client ) ) {
+    errorText = "MidiInAlsaShared::initialize: error starting the shared MIDI input thread!";
+    close( client->trigger_fds[0] );
+    close( client->trigger_fds[1] );
+    snd_midi_event_free( client->coder );
+    snd_seq_close( client->seq );
+    delete client;
+    return 0;
+  }
+
+  alsaShared = client;
+  return client;
+}
+
+// Releases the shared client, destroying it with its last user.
+static void alsaSharedRelease( void )
+{
+  std::lock_guard<std::mutex> lock( alsaSharedMutex );
+  if ( !alsaShared || --alsaShared->users > 0 ) return;
+
+  AlsaSharedClient *client = alsaShared;
+  alsaShared = 0;
+  client->running = false;
+  int res = write( client->trigger_fds[1], &client->running, sizeof( client->running ) );
+  (void) res;
+  pthread_join( client->thread, NULL );
+
+  close( client->trigger_fds[0] );
+  close( client->trigger_fds[1] );
+  snd_midi_event_free( client->coder );
+#ifndef AVOID_TIMESTAMPING
+  snd_seq_free_queue( client->seq, client->queue_id );
+#endif
+  snd_seq_close( client->seq );
+  delete client;
+}
+
+MidiInAlsaShared :: MidiInAlsaShared( const std::string &clientName, unsigned int queueSizeLimit )
+  : MidiInApi( queueSizeLimit )
+{
+  MidiInAlsaShared::initialize( clientName );
+}
+
+MidiInAlsaShared :: ~MidiInAlsaShared()
+{
+  MidiInAlsaShared::closePort();
+  alsaUnlockMemory( threadStatus_ );
+
+  AlsaSharedData *data = static_cast<AlsaSharedData *> (apiData_);
+  if ( !data ) return;
+  if ( data->client ) alsaSharedRelease();
+  delete data;
+}
+
+void MidiInAlsaShared :: initialize( const std::string& clientName )
+{
+  AlsaSharedData *data = new AlsaSharedData;
+  data->subscription = 0;
+  data->lastTimeNs = 0;
+  data->continueSysex = false;
+  apiData_ = (void *) data;
+  inputData_.apiData = (void *) data;
+
+  // The name of the first instance names the shared client.
+  data->client = alsaSharedAcquire( clientName, errorString_ );
+  if ( !data->client ) {
+    error( RtMidiError::DRIVER_ERROR, errorString_ );
+    return;
+  }
+}
+
+unsigned int MidiInAlsaShared :: getPortCount()
+{
+  AlsaSharedData *data = static_cast<AlsaSharedData *> (apiData_);
+  if ( !data->client ) return 0;
+
+  snd_seq_port_info_t *pinfo;
+  snd_seq_port_info_alloca( &pinfo );
+  return portInfo( data->client->seq, pinfo, SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ, -1 );
+}
+
+std::string MidiInAlsaShared :: getPortName( unsigned int portNumber )
+{
+  AlsaSharedData *data = static_cast<AlsaSharedData *> (apiData_);
+  snd_seq_port_info_t *pinfo;
+  snd_seq_port_info_alloca( &pinfo );
+  if ( data->client && portInfo( data->client->seq, pinfo, SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ, (int) portNumber ) )
+    return alsaPortName( data->client->seq, pinfo );
+
+  errorString_ = "MidiInAlsaShared::getPortName: error looking for port name!";
+  error( RtMidiError::WARNING, errorString_ );
+  return std::string();
+}
+
+void MidiInAlsaShared :: openPort( unsigned int portNumber, const std::string &/*portName*/ )
+{
+  if ( connected_ ) {
+    errorString_ = "MidiInAlsaShared::openPort: a valid connection already exists!";
+    error( RtMidiError::WARNING, errorString_ );
+    return;
+  }
+
+  AlsaSharedData *data = static_cast<AlsaSharedData *> (apiData_);
+  if ( !data->client ) {
+    errorString_ = "MidiInAlsaShared::openPort: no shared ALSA client!";
+    error( RtMidiError::DRIVER_ERROR, errorString_ );
+    return;
+  }
+  AlsaSharedClient *client = data->client;
+
+  snd_seq_port_info_t *src_pinfo;
+  snd_seq_port_info_alloca( &src_pinfo );
+  if ( portInfo( client->seq, src_pinfo, SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ, (int) portNumber ) == 0 ) {
+    std::ostringstream ost;
+    ost << "MidiInAlsaShared::openPort: the 'portNumber' argument (" << portNumber << ") is invalid.";
+    errorString_ = ost.str();
+    error( RtMidiError::INVALID_PARAMETER, errorString_ );
+    return;
+  }
+
+  snd_seq_addr_t receiver;
+  data->source.client = snd_seq_port_info_get_client( src_pinfo );
+  data->source.port = snd_seq_port_info_get_port( src_pinfo );
+  receiver.client = snd_seq_client_id( client->seq );
+  receiver.port = client->vport;
+
+  {
+    std::lock_guard<std::mutex> lock( client->mutex );
+    if ( client->sources.count( alsaSourceKey( data->source ) ) ) {
+      errorString_ = "MidiInAlsaShared::openPort: this port is already open in another instance.";
+      error( RtMidiError::WARNING, errorString_ );
+      return;
+    }
+    data->lastTimeNs = 0;
+    data->continueSysex = false;
+    data->batch.count = 0;
+    data->batch.used = 0;
+    inputData_.firstMessage = true;
+    inputData_.doInput = true;
+    client->sources[alsaSourceKey( data->source )] = &inputData_;
+  }
+  applyEventFilter();
+
+  if ( snd_seq_port_subscribe_malloc( &data->subscription ) < 0 ) {
+    data->subscription = 0;
+  }
+  else {
+    snd_seq_port_subscribe_set_sender( data->subscription, &data->source );
+    snd_seq_port_subscribe_set_dest( data->subscription, &receiver );
+    if ( snd_seq_subscribe_port( client->seq, data->subscription ) ) {
+      snd_seq_port_subscribe_free( data->subscription );
+      data->subscription = 0;
+    }
+  }
+
+  if ( !data->subscription ) {
+    {
+      std::lock_guard<std::mutex> lock( client->mutex );
+      client->sources.erase( alsaSourceKey( data->source ) );
+      inputData_.doInput = false;
+    }
+    applyEventFilter();
+    errorString_ = "MidiInAlsaShared::openPort: ALSA error making port connection.";
+    error( RtMidiError::DRIVER_ERROR, errorString_ );
+    return;
+  }
+
+  connected_ = true;
+}
+
+void MidiInAlsaShared :: openVirtualPort( const std::string &/*portName*/ )
+{
+  errorString_ = "MidiInAlsaShared::openVirtualPort: the shared ALSA client cannot create virtual ports, use the ALSA sequencer API.";
+  error( RtMidiError::WARNING, errorString_ );
+}
+
+void MidiInAlsaShared :: closePort( void )
+{
+  if ( !connected_ ) return;
+
+  AlsaSharedData *data = static_cast<AlsaSharedData *> (apiData_);
+  snd_seq_unsubscribe_port( data->client->seq, data->subscription );
+  snd_seq_port_subscribe_free( data->subscription );
+  data->subscription = 0;
+
+  // Waits for a dispatch in progress, nothing is delivered afterwards.
+  // A callback cannot wait for its own dispatch: the rest of its batch is
+  // dropped instead.
+  {
+    AlsaSharedClient *client = data->client;
+    std::unique_lock<std::mutex> lock( client->mutex );
+    client->sources.erase( alsaSourceKey( data->source ) );
+    std::replace( client->pending.begin(), client->pending.end(), &inputData_, (MidiInApi::RtMidiInData *) 0 );
+    if ( !pthread_equal( pthread_self(), client->thread ) ) {
+      while ( client->dispatching == &inputData_ )
+        client->dispatched.wait( lock );
+    }
+    data->batch.count = 0;
+    data->batch.used = 0;
+    inputData_.doInput = false;
+    connected_ = false;
+  }
+  applyEventFilter();
+}
+
+void MidiInAlsaShared :: ignoreTypes( bool midiSysex, bool midiTime, bool midiSense )
+{
+  MidiInApi::ignoreTypes( midiSysex, midiTime, midiSense );
+  applyEventFilter();
+}
+
+void MidiInAlsaShared :: acceptChannelMessages( unsigned int kinds )
+{
+  MidiInApi::acceptChannelMessages( kinds );
+  applyEventFilter();
+}
+
+// Recomputes the filter of the shared client from the open instances.
+void MidiInAlsaShared :: applyEventFilter( void )
+{
+  AlsaSharedData *data = static_cast<AlsaSharedData *> (apiData_);
+  if ( !data || !data->client ) return;
+
+  bool filtered;
+  {
+    std::lock_guard<std::mutex> lock( data->client->mutex );
+    filtered = alsaSharedSetEventFilter( data->client );
+  }
+  if ( !filtered ) {
+    errorString_ = "MidiInAlsaShared::applyEventFilter: error setting the client event filter, ignored events are dropped on input.";
+    error( RtMidiError::WARNING, errorString_ );
+  }
+}
+
+void MidiInAlsaShared :: setClientName( const std::string &/*clientName*/ )
+{
+  errorString_ = "MidiInAlsaShared::setClientName: the client is shared by all the instances and keeps its name!";
+  error( RtMidiError::WARNING, errorString_ );
+}
+
+void MidiInAlsaShared :: setPortName( const std::string &/*portName*/ )
+{
+  errorString_ = "MidiInAlsaShared::setPortName: the input port is shared by all the instances and keeps its name!";
+  error( RtMidiError::WARNING, errorString_ );
+}
+
+// The thread is shared, the last options set by any instance apply.
+void MidiInAlsaShared :: setThreadOptions( const RtMidiIn::ThreadOptions &options )
+{
+  threadOptions_ = options;
+  AlsaSharedData *data = static_cast<AlsaSharedData *> (apiData_);
+  if ( !data->client ) return;
+
+  std::vector<std::string> warnings;
+  alsaApplyThreadOptions( data->client->thread, threadOptions_, threadStatus_, "MidiInAlsaShared::setThreadOptions", warnings );
+  for ( size_t i=0; i<warnings.size(); ++i ) {
+    errorString_ = warnings[i];
+    error( RtMidiError::WARNING, errorString_ );
+  }
+}
+
+//*********************************************************************//
+//  API: LINUX ALSA
+//  Class Definitions: MidiOutAlsa
+//*********************************************************************//
+
+MidiOutAlsa :: MidiOutAlsa( const std::string &clientName ) : MidiOutApi()
+{
+  MidiOutAlsa::initialize( clientName );
+}
+
+MidiOutAlsa :: ~MidiOutAlsa()
+{
+  // Close a connection if it exists.
+  MidiOutAlsa::closePort();
+
+  // Cleanup.
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  if ( data->vport >= 0 ) snd_seq_delete_port( data->seq, data->vport );
+  if ( data->coder ) snd_midi_event_free( data->coder );
+  if ( data->buffer ) free( data->buffer );
+  snd_seq_close( data->seq );
+  delete data;
+}
+
+void MidiOutAlsa :: initialize( const std::string& clientName )
+{
+  // Set up the ALSA sequencer client.
+  snd_seq_t *seq;
+  int result1 = snd_seq_open( &seq, "default", SND_SEQ_OPEN_OUTPUT, SND_SEQ_NONBLOCK );
+  if ( result1 < 0 ) {
+    errorString_ = "MidiOutAlsa::initialize: error creating ALSA sequencer client object.";
+    error( RtMidiError::DRIVER_ERROR, errorString_ );
+    return;
+  }
+
+  // Set client name.
+  snd_seq_set_client_name( seq, clientName.c_str() );
+
+  // Save our api-specific connection information.
+  AlsaMidiData *data = (AlsaMidiData *) new AlsaMidiData;
+  data->seq = seq;
+  data->portNum = -1;
+  data->vport = -1;
+  data->bufferSize = 32;
+  data->coder = 0;
+  data->buffer = 0;
+  int result = snd_midi_event_new( data->bufferSize, &data->coder );
   if ( result < 0 ) {
     delete data;
     errorString_ = "MidiOutAlsa::initialize: error initializing MIDI event parser!\n\n";
@@ -2184,193 +3727,503 @@ std::string MidiOutAlsa :: getPortName( unsigned int portNumber )
   snd_seq_port_info_alloca( &pinfo );
 
   std::string stringName;
-  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
-  if ( portInfo( data->seq, pinfo, SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE, (int) portNumber ) ) {
-    int cnum = snd_seq_port_info_get_client( pinfo );
-    snd_seq_get_any_client_info( data->seq, cnum, cinfo );
-    std::ostringstream os;
-    os << snd_seq_client_info_get_name( cinfo );
-    os << ":";
-    os << snd_seq_port_info_get_name( pinfo );
-    os << " ";                                    // These lines added to make sure devices are listed
-    os << snd_seq_port_info_get_client( pinfo );  // with full portnames added to ensure individual device names
-    os << ":";
-    os << snd_seq_port_info_get_port( pinfo );
-    stringName = os.str();
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  if ( portInfo( data->seq, pinfo, SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE, (int) portNumber ) ) {
+    int cnum = snd_seq_port_info_get_client( pinfo );
+    snd_seq_get_any_client_info( data->seq, cnum, cinfo );
+    std::ostringstream os;
+    os << snd_seq_client_info_get_name( cinfo );
+    os << ":";
+    os << snd_seq_port_info_get_name( pinfo );
+    os << " ";                                    // These lines added to make sure devices are listed
+    os << snd_seq_port_info_get_client( pinfo );  // with full portnames added to ensure individual device names
+    os << ":";
+    os << snd_seq_port_info_get_port( pinfo );
+    stringName = os.str();
+    return stringName;
+  }
+
+  // If we get here, we didn't find a match.
+  errorString_ = "MidiOutAlsa::getPortName: error looking for port name!";
+  error( RtMidiError::WARNING, errorString_ );
+  return stringName;
+}
+
+void MidiOutAlsa :: openPort( unsigned int portNumber, const std::string &portName )
+{
+  if ( connected_ ) {
+    errorString_ = "MidiOutAlsa::openPort: a valid connection already exists!";
+    error( RtMidiError::WARNING, errorString_ );
+    return;
+  }
+
+  unsigned int nSrc = this->getPortCount();
+  if ( nSrc < 1 ) {
+    errorString_ = "MidiOutAlsa::openPort: no MIDI output sources found!";
+    error( RtMidiError::NO_DEVICES_FOUND, errorString_ );
+    return;
+  }
+
+  snd_seq_port_info_t *pinfo;
+  snd_seq_port_info_alloca( &pinfo );
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  if ( portInfo( data->seq, pinfo, SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE, (int) portNumber ) == 0 ) {
+    std::ostringstream ost;
+    ost << "MidiOutAlsa::openPort: the 'portNumber' argument (" << portNumber << ") is invalid.";
+    errorString_ = ost.str();
+    error( RtMidiError::INVALID_PARAMETER, errorString_ );
+    return;
+  }
+
+  snd_seq_addr_t sender, receiver;
+  receiver.client = snd_seq_port_info_get_client( pinfo );
+  receiver.port = snd_seq_port_info_get_port( pinfo );
+  sender.client = snd_seq_client_id( data->seq );
+
+  if ( data->vport < 0 ) {
+    data->vport = snd_seq_create_simple_port( data->seq, portName.c_str(),
+                                              SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ,
+                                              SND_SEQ_PORT_TYPE_MIDI_GENERIC|SND_SEQ_PORT_TYPE_APPLICATION );
+    if ( data->vport < 0 ) {
+      errorString_ = "MidiOutAlsa::openPort: ALSA error creating output port.";
+      error( RtMidiError::DRIVER_ERROR, errorString_ );
+      return;
+    }
+  }
+
+  sender.port = data->vport;
+
+  // Make subscription
+  if ( snd_seq_port_subscribe_malloc( &data->subscription ) < 0 ) {
+    snd_seq_port_subscribe_free( data->subscription );
+    errorString_ = "MidiOutAlsa::openPort: error allocating port subscription.";
+    error( RtMidiError::DRIVER_ERROR, errorString_ );
+    return;
+  }
+  snd_seq_port_subscribe_set_sender( data->subscription, &sender );
+  snd_seq_port_subscribe_set_dest( data->subscription, &receiver );
+  snd_seq_port_subscribe_set_time_update( data->subscription, 1 );
+  snd_seq_port_subscribe_set_time_real( data->subscription, 1 );
+  if ( snd_seq_subscribe_port( data->seq, data->subscription ) ) {
+    snd_seq_port_subscribe_free( data->subscription );
+    errorString_ = "MidiOutAlsa::openPort: ALSA error making port connection.";
+    error( RtMidiError::DRIVER_ERROR, errorString_ );
+    return;
+  }
+
+  connected_ = true;
+}
+
+void MidiOutAlsa :: closePort( void )
+{
+  if ( connected_ ) {
+    AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+    snd_seq_unsubscribe_port( data->seq, data->subscription );
+    snd_seq_port_subscribe_free( data->subscription );
+    data->subscription = 0;
+    connected_ = false;
+  }
+}
+
+void MidiOutAlsa :: setClientName( const std::string &clientName )
+{
+
+    AlsaMidiData *data = static_cast<AlsaMidiData *> ( apiData_ );
+    snd_seq_set_client_name( data->seq, clientName.c_str() );
+
+}
+
+void MidiOutAlsa :: setPortName( const std::string &portName )
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  snd_seq_port_info_t *pinfo;
+  snd_seq_port_info_alloca( &pinfo );
+  snd_seq_get_port_info( data->seq, data->vport, pinfo );
+  snd_seq_port_info_set_name( pinfo, portName.c_str() );
+  snd_seq_set_port_info( data->seq, data->vport, pinfo );
+}
+
+void MidiOutAlsa :: openVirtualPort( const std::string &portName )
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  if ( data->vport < 0 ) {
+    data->vport = snd_seq_create_simple_port( data->seq, portName.c_str(),
+                                              SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ,
+                                              SND_SEQ_PORT_TYPE_MIDI_GENERIC|SND_SEQ_PORT_TYPE_APPLICATION );
+
+    if ( data->vport < 0 ) {
+      errorString_ = "MidiOutAlsa::openVirtualPort: ALSA error creating virtual port.";
+      error( RtMidiError::DRIVER_ERROR, errorString_ );
+    }
+  }
+}
+
+void MidiOutAlsa :: sendMessage( const unsigned char *message, size_t size )
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  if ( outputMessage( message, size ) )
+    snd_seq_drain_output( data->seq );
+}
+
+void MidiOutAlsa :: sendMessages( const RtMidiOut::Message *messages, size_t count )
+{
+  // The events pile up in the sequencer output buffer (which flushes
+  // itself when full) and are drained once for the whole batch.
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  for ( size_t i=0; i<count; ++i )
+    outputMessage( messages[i].bytes, messages[i].size );
+  snd_seq_drain_output( data->seq );
+}
+
+// Encodes the message into the sequencer output buffer, without draining it.
+bool MidiOutAlsa :: outputMessage( const unsigned char *message, size_t size )
+{
+  long result;
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  unsigned int nBytes = static_cast<unsigned int> (size);
+  if ( nBytes > data->bufferSize ) {
+    data->bufferSize = nBytes;
+    result = snd_midi_event_resize_buffer( data->coder, nBytes );
+    if ( result != 0 ) {
+      errorString_ = "MidiOutAlsa::sendMessage: ALSA error resizing MIDI event buffer.";
+      error( RtMidiError::DRIVER_ERROR, errorString_ );
+      return false;
+    }
+    free (data->buffer);
+    data->buffer = (unsigned char *) malloc( data->bufferSize );
+    if ( data->buffer == NULL ) {
+      errorString_ = "MidiOutAlsa::initialize: error allocating buffer memory!\n\n";
+      error( RtMidiError::MEMORY_ERROR, errorString_ );
+      return false;
+    }
+  }
+
+  for ( unsigned int i=0; i<nBytes; ++i ) data->buffer[i] = message[i];
+
+  unsigned int offset = 0;
+  while (offset < nBytes) {
+    snd_seq_event_t ev;
+    snd_seq_ev_clear( &ev );
+    snd_seq_ev_set_source( &ev, data->vport );
+    snd_seq_ev_set_subs( &ev );
+    snd_seq_ev_set_direct( &ev );
+    result = snd_midi_event_encode( data->coder, data->buffer + offset,
+                                    (long)(nBytes - offset), &ev );
+    if ( result < 0 ) {
+      errorString_ = "MidiOutAlsa::sendMessage: event parsing error!";
+      error( RtMidiError::WARNING, errorString_ );
+      return false;
+    }
+
+    if ( ev.type == SND_SEQ_EVENT_NONE ) {
+      errorString_ = "MidiOutAlsa::sendMessage: incomplete message!";
+      error( RtMidiError::WARNING, errorString_ );
+      return false;
+    }
+
+    offset += result;
+
+    // Send the event.
+    result = snd_seq_event_output( data->seq, &ev );
+    if ( result < 0 ) {
+      errorString_ = "MidiOutAlsa::sendMessage: error sending MIDI message to port.";
+      error( RtMidiError::WARNING, errorString_ );
+      return false;
+    }
+  }
+  return true;
+}
+
+//*********************************************************************//
+//  API: LINUX ALSA RAWMIDI
+//  Class Definitions: MidiInAlsaRaw
+//*********************************************************************//
+
+// The rawmidi interface reads the bytes sent by a hardware device
+// straight from the kernel driver, without the sequencer client, queue
+// and event decoding in between.  Only hardware ports are available, and
+// the byte stream is parsed by MidiInApi::MidiParser.  Messages are
+// timestamped when they are read.
+
+// A structure to hold variables related to the ALSA rawmidi
+// implementation.
+struct AlsaRawMidiData {
+  snd_rawmidi_t *rawmidi;
+  pthread_t thread;
+  pthread_t dummy_thread_id;
+  MidiInApi::MidiParser parser;
+  int trigger_fds[2];
+};
+
+// Size of the buffer handed to snd_rawmidi_read().
+#define RTMIDI_ALSA_RAW_READ_SIZE 256
+
+// This function is used to count the hardware input ports or to get the
+// device ("hw:card,device,subdevice") and display name of a given port.
+static unsigned int rawmidiPortInfo( int portNumber, std::string *device, std::string *name )
+{
+  snd_rawmidi_info_t *info;
+  snd_rawmidi_info_alloca( &info );
+  int count = 0;
+
+  int card = -1;
+  while ( snd_card_next( &card ) >= 0 && card >= 0 ) {
+    std::ostringstream cardName;
+    cardName << "hw:" << card;
+    snd_ctl_t *ctl;
+    if ( snd_ctl_open( &ctl, cardName.str().c_str(), 0 ) < 0 ) continue;
+
+    int dev = -1;
+    while ( snd_ctl_rawmidi_next_device( ctl, &dev ) >= 0 && dev >= 0 ) {
+      snd_rawmidi_info_set_device( info, dev );
+      snd_rawmidi_info_set_subdevice( info, 0 );
+      snd_rawmidi_info_set_stream( info, SND_RAWMIDI_STREAM_INPUT );
+      if ( snd_ctl_rawmidi_info( ctl, info ) < 0 ) continue; // output only
+
+      unsigned int subdevices = snd_rawmidi_info_get_subdevices_count( info );
+      for ( unsigned int sub=0; sub<subdevices; ++sub ) {
+        snd_rawmidi_info_set_subdevice( info, sub );
+        if ( snd_ctl_rawmidi_info( ctl, info ) < 0 ) continue;
+        if ( count == portNumber ) {
+          std::ostringstream os;
+          os << "hw:" << card << "," << dev << "," << sub;
+          if ( device ) *device = os.str();
+          if ( name ) {
+            const char *subName = snd_rawmidi_info_get_subdevice_name( info );
+            *name = ( subName && *subName ) ? subName : snd_rawmidi_info_get_name( info );
+            *name += " " + os.str();
+          }
+          snd_ctl_close( ctl );
+          return 1;
+        }
+        ++count;
+      }
+    }
+    snd_ctl_close( ctl );
+  }
+
+  // If a negative portNumber was used, return the port count.
+  if ( portNumber < 0 ) return count;
+  return 0;
+}
+
+static void *alsaRawMidiHandler( void *ptr )
+{
+  MidiInApi::RtMidiInData *data = static_cast<MidiInApi::RtMidiInData *> (ptr);
+  AlsaRawMidiData *apiData = static_cast<AlsaRawMidiData *> (data->apiData);
+
+  unsigned char buffer[RTMIDI_ALSA_RAW_READ_SIZE];
+  MidiInApi::MessageBatch batch;
+
+  int poll_fd_count = snd_rawmidi_poll_descriptors_count( apiData->rawmidi ) + 1;
+  struct pollfd *poll_fds = (struct pollfd*)alloca( poll_fd_count * sizeof( struct pollfd ));
+  snd_rawmidi_poll_descriptors( apiData->rawmidi, poll_fds + 1, poll_fd_count - 1 );
+  poll_fds[0].fd = apiData->trigger_fds[0];
+  poll_fds[0].events = POLLIN;
+
+  while ( data->doInput ) {
+
+    if ( poll( poll_fds, poll_fd_count, -1 ) < 0 ) continue;
+    if ( poll_fds[0].revents & POLLIN ) {
+      bool dummy;
+      int res = read( poll_fds[0].fd, &dummy, sizeof(dummy) );
+      (void) res;
+      continue;
+    }
+
+    // Read everything the driver has buffered and deliver the messages
+    // together.  All the bytes of one read share its timestamp.
+    long nBytes = 0;
+    while ( data->doInput && ( nBytes = snd_rawmidi_read( apiData->rawmidi, buffer, sizeof(buffer) ) ) > 0 )
+      apiData->parser.parse( *data, batch, buffer, nBytes, RtMidi::getTimeNs() );
+
+    data->dispatch( batch );
+
+    if ( nBytes < 0 && nBytes != -EAGAIN ) {
+      // The device went away (-ENODEV) or failed, polling it again would
+      // only spin.  The thread is joined by closePort().
+      RTMIDI_LOG_WARN( "\nMidiInAlsaRaw::alsaRawMidiHandler: error reading MIDI input (" << snd_strerror( (int) nBytes ) << "), stopping input!\n\n" );
+      data->doInput = false;
+    }
+  }
+
+  return 0;
+}
+
+MidiInAlsaRaw :: MidiInAlsaRaw( const std::string &clientName, unsigned int queueSizeLimit )
+  : MidiInApi( queueSizeLimit )
+{
+  MidiInAlsaRaw::initialize( clientName );
+}
+
+MidiInAlsaRaw :: ~MidiInAlsaRaw()
+{
+  // Close a connection if it exists and stop the input thread.
+  MidiInAlsaRaw::closePort();
+  alsaUnlockMemory( threadStatus_ );
+
+  // Cleanup.
+  AlsaRawMidiData *data = static_cast<AlsaRawMidiData *> (apiData_);
+  close ( data->trigger_fds[0] );
+  close ( data->trigger_fds[1] );
+  delete data;
+}
+
+void MidiInAlsaRaw :: initialize( const std::string& /*clientName*/ )
+{
+  // Save our api-specific connection information.  There is no client
+  // to create, the device is opened in openPort().
+  AlsaRawMidiData *data = new AlsaRawMidiData;
+  data->rawmidi = 0;
+  data->dummy_thread_id = pthread_self();
+  data->thread = data->dummy_thread_id;
+  data->trigger_fds[0] = -1;
+  data->trigger_fds[1] = -1;
+  apiData_ = (void *) data;
+  inputData_.apiData = (void *) data;
+
+  if ( pipe(data->trigger_fds) == -1 ) {
+    errorString_ = "MidiInAlsaRaw::initialize: error creating pipe objects.";
+    error( RtMidiError::DRIVER_ERROR, errorString_ );
+    return;
+  }
+}
+
+unsigned int MidiInAlsaRaw :: getPortCount()
+{
+  return rawmidiPortInfo( -1, 0, 0 );
+}
+
+std::string MidiInAlsaRaw :: getPortName( unsigned int portNumber )
+{
+  std::string stringName;
+  if ( rawmidiPortInfo( (int) portNumber, 0, &stringName ) )
     return stringName;
-  }
 
   // If we get here, we didn't find a match.
-  errorString_ = "MidiOutAlsa::getPortName: error looking for port name!";
+  errorString_ = "MidiInAlsaRaw::getPortName: error looking for port name!";
   error( RtMidiError::WARNING, errorString_ );
   return stringName;
 }
 
-void MidiOutAlsa :: openPort( unsigned int portNumber, const std::string &portName )
+void MidiInAlsaRaw :: openPort( unsigned int portNumber, const std::string &/*portName*/ )
 {
   if ( connected_ ) {
-    errorString_ = "MidiOutAlsa::openPort: a valid connection already exists!";
+    errorString_ = "MidiInAlsaRaw::openPort: a valid connection already exists!";
     error( RtMidiError::WARNING, errorString_ );
     return;
   }
 
   unsigned int nSrc = this->getPortCount();
   if ( nSrc < 1 ) {
-    errorString_ = "MidiOutAlsa::openPort: no MIDI output sources found!";
+    errorString_ = "MidiInAlsaRaw::openPort: no MIDI input sources found!";
     error( RtMidiError::NO_DEVICES_FOUND, errorString_ );
     return;
   }
 
-  snd_seq_port_info_t *pinfo;
-  snd_seq_port_info_alloca( &pinfo );
-  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
-  if ( portInfo( data->seq, pinfo, SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE, (int) portNumber ) == 0 ) {
+  std::string device;
+  if ( rawmidiPortInfo( (int) portNumber, &device, 0 ) == 0 ) {
     std::ostringstream ost;
-    ost << "MidiOutAlsa::openPort: the 'portNumber' argument (" << portNumber << ") is invalid.";
+    ost << "MidiInAlsaRaw::openPort: the 'portNumber' argument (" << portNumber << ") is invalid.";
     errorString_ = ost.str();
     error( RtMidiError::INVALID_PARAMETER, errorString_ );
     return;
   }
 
-  snd_seq_addr_t sender, receiver;
-  receiver.client = snd_seq_port_info_get_client( pinfo );
-  receiver.port = snd_seq_port_info_get_port( pinfo );
-  sender.client = snd_seq_client_id( data->seq );
-
-  if ( data->vport < 0 ) {
-    data->vport = snd_seq_create_simple_port( data->seq, portName.c_str(),
-                                              SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ,
-                                              SND_SEQ_PORT_TYPE_MIDI_GENERIC|SND_SEQ_PORT_TYPE_APPLICATION );
-    if ( data->vport < 0 ) {
-      errorString_ = "MidiOutAlsa::openPort: ALSA error creating output port.";
-      error( RtMidiError::DRIVER_ERROR, errorString_ );
-      return;
-    }
-  }
-
-  sender.port = data->vport;
-
-  // Make subscription
-  if ( snd_seq_port_subscribe_malloc( &data->subscription ) < 0 ) {
-    snd_seq_port_subscribe_free( data->subscription );
-    errorString_ = "MidiOutAlsa::openPort: error allocating port subscription.";
+  AlsaRawMidiData *data = static_cast<AlsaRawMidiData *> (apiData_);
+  int result = snd_rawmidi_open( &data->rawmidi, NULL, device.c_str(), SND_RAWMIDI_NONBLOCK );
+  if ( result < 0 ) {
+    data->rawmidi = 0;
+    std::ostringstream ost;
+    ost << "MidiInAlsaRaw::openPort: error opening " << device << " (" << snd_strerror( result ) << ").";
+    errorString_ = ost.str();
     error( RtMidiError::DRIVER_ERROR, errorString_ );
     return;
   }
-  snd_seq_port_subscribe_set_sender( data->subscription, &sender );
-  snd_seq_port_subscribe_set_dest( data->subscription, &receiver );
-  snd_seq_port_subscribe_set_time_update( data->subscription, 1 );
-  snd_seq_port_subscribe_set_time_real( data->subscription, 1 );
-  if ( snd_seq_subscribe_port( data->seq, data->subscription ) ) {
-    snd_seq_port_subscribe_free( data->subscription );
-    errorString_ = "MidiOutAlsa::openPort: ALSA error making port connection.";
-    error( RtMidiError::DRIVER_ERROR, errorString_ );
+
+  // Do not resume in the middle of a message from a previous port, nor
+  // measure the first delta time from its last message.
+  data->parser.reset();
+  inputData_.firstMessage = true;
+
+  // Start our MIDI input thread.
+  pthread_attr_t attr;
+  pthread_attr_init( &attr );
+  pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_JOINABLE );
+  pthread_attr_setschedpolicy( &attr, SCHED_OTHER );
+
+  inputData_.doInput = true;
+  int err = pthread_create( &data->thread, &attr, alsaRawMidiHandler, &inputData_ );
+  pthread_attr_destroy( &attr );
+  if ( err ) {
+    data->thread = data->dummy_thread_id;
+    snd_rawmidi_close( data->rawmidi );
+    data->rawmidi = 0;
+    inputData_.doInput = false;
+    errorString_ = "MidiInAlsaRaw::openPort: error starting MIDI input thread!";
+    error( RtMidiError::THREAD_ERROR, errorString_ );
     return;
   }
+  applyThreadOptions();
 
   connected_ = true;
 }
 
-void MidiOutAlsa :: closePort( void )
+void MidiInAlsaRaw :: openVirtualPort( const std::string &/*portName*/ )
 {
-  if ( connected_ ) {
-    AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
-    snd_seq_unsubscribe_port( data->seq, data->subscription );
-    snd_seq_port_subscribe_free( data->subscription );
-    data->subscription = 0;
-    connected_ = false;
-  }
+  errorString_ = "MidiInAlsaRaw::openVirtualPort: the ALSA rawmidi API cannot create virtual ports, use the ALSA sequencer API.";
+  error( RtMidiError::WARNING, errorString_ );
 }
 
-void MidiOutAlsa :: setClientName( const std::string &clientName )
+void MidiInAlsaRaw :: closePort( void )
 {
+  AlsaRawMidiData *data = static_cast<AlsaRawMidiData *> (apiData_);
 
-    AlsaMidiData *data = static_cast<AlsaMidiData *> ( apiData_ );
-    snd_seq_set_client_name( data->seq, clientName.c_str() );
+  // Stop the thread first, it may also have stopped on its own after a
+  // read error.
+  if ( !pthread_equal( data->thread, data->dummy_thread_id ) ) {
+    inputData_.doInput = false;
+    int res = write( data->trigger_fds[1], &inputData_.doInput, sizeof( inputData_.doInput ) );
+    (void) res;
+    pthread_join( data->thread, NULL );
+    data->thread = data->dummy_thread_id;
+  }
 
+  if ( data->rawmidi ) {
+    snd_rawmidi_close( data->rawmidi );
+    data->rawmidi = 0;
+  }
+  connected_ = false;
 }
 
-void MidiOutAlsa :: setPortName( const std::string &portName )
+void MidiInAlsaRaw :: setClientName( const std::string &/*clientName*/ )
 {
-  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
-  snd_seq_port_info_t *pinfo;
-  snd_seq_port_info_alloca( &pinfo );
-  snd_seq_get_port_info( data->seq, data->vport, pinfo );
-  snd_seq_port_info_set_name( pinfo, portName.c_str() );
-  snd_seq_set_port_info( data->seq, data->vport, pinfo );
+  errorString_ = "MidiInAlsaRaw::setClientName: this function is not implemented for the ALSA rawmidi API!";
+  error( RtMidiError::WARNING, errorString_ );
 }
 
-void MidiOutAlsa :: openVirtualPort( const std::string &portName )
+void MidiInAlsaRaw :: setPortName( const std::string &/*portName*/ )
 {
-  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
-  if ( data->vport < 0 ) {
-    data->vport = snd_seq_create_simple_port( data->seq, portName.c_str(),
-                                              SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ,
-                                              SND_SEQ_PORT_TYPE_MIDI_GENERIC|SND_SEQ_PORT_TYPE_APPLICATION );
-
-    if ( data->vport < 0 ) {
-      errorString_ = "MidiOutAlsa::openVirtualPort: ALSA error creating virtual port.";
-      error( RtMidiError::DRIVER_ERROR, errorString_ );
-    }
-  }
+  errorString_ = "MidiInAlsaRaw::setPortName: this function is not implemented for the ALSA rawmidi API!";
+  error( RtMidiError::WARNING, errorString_ );
 }
 
-void MidiOutAlsa :: sendMessage( const unsigned char *message, size_t size )
+void MidiInAlsaRaw :: setThreadOptions( const RtMidiIn::ThreadOptions &options )
 {
-  long result;
-  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
-  unsigned int nBytes = static_cast<unsigned int> (size);
-  if ( nBytes > data->bufferSize ) {
-    data->bufferSize = nBytes;
-    result = snd_midi_event_resize_buffer( data->coder, nBytes );
-    if ( result != 0 ) {
-      errorString_ = "MidiOutAlsa::sendMessage: ALSA error resizing MIDI event buffer.";
-      error( RtMidiError::DRIVER_ERROR, errorString_ );
-      return;
-    }
-    free (data->buffer);
-    data->buffer = (unsigned char *) malloc( data->bufferSize );
-    if ( data->buffer == NULL ) {
-      errorString_ = "MidiOutAlsa::initialize: error allocating buffer memory!\n\n";
-      error( RtMidiError::MEMORY_ERROR, errorString_ );
-      return;
-    }
-  }
-
-  for ( unsigned int i=0; i<nBytes; ++i ) data->buffer[i] = message[i];
-
-  unsigned int offset = 0;
-  while (offset < nBytes) {
-    snd_seq_event_t ev;
-    snd_seq_ev_clear( &ev );
-    snd_seq_ev_set_source( &ev, data->vport );
-    snd_seq_ev_set_subs( &ev );
-    snd_seq_ev_set_direct( &ev );
-    result = snd_midi_event_encode( data->coder, data->buffer + offset,
-                                    (long)(nBytes - offset), &ev );
-    if ( result < 0 ) {
-      errorString_ = "MidiOutAlsa::sendMessage: event parsing error!";
-      error( RtMidiError::WARNING, errorString_ );
-      return;
-    }
-
-    if ( ev.type == SND_SEQ_EVENT_NONE ) {
-      errorString_ = "MidiOutAlsa::sendMessage: incomplete message!";
-      error( RtMidiError::WARNING, errorString_ );
-      return;
-    }
-
-    offset += result;
+  threadOptions_ = options;
+  if ( inputData_.doInput ) applyThreadOptions();
+}
 
-    // Send the event.
-    result = snd_seq_event_output( data->seq, &ev );
-    if ( result < 0 ) {
-      errorString_ = "MidiOutAlsa::sendMessage: error sending MIDI message to port.";
-      error( RtMidiError::WARNING, errorString_ );
-      return;
-    }
+// Applies threadOptions_ to the running input thread.
+void MidiInAlsaRaw :: applyThreadOptions( void )
+{
+  AlsaRawMidiData *data = static_cast<AlsaRawMidiData *> (apiData_);
+  std::vector<std::string> warnings;
+  alsaApplyThreadOptions( data->thread, threadOptions_, threadStatus_, "MidiInAlsaRaw::applyThreadOptions", warnings );
+  for ( size_t i=0; i<warnings.size(); ++i ) {
+    errorString_ = warnings[i];
+    error( RtMidiError::WARNING, errorString_ );
   }
-  snd_seq_drain_output( data->seq );
 }
 
 #endif // __LINUX_ALSA__
@@ -2394,6 +4247,7 @@ void MidiOutAlsa :: sendMessage( const unsigned char *message, size_t size )
 // Windows MM MIDI header files.
 #include <windows.h>
 #include <mmsystem.h>
+#include <dbt.h>
 
 // Convert a null-terminated wide string or ANSI-encoded string to UTF-8.
 static std::string ConvertToUTF8(const TCHAR *str)
@@ -2432,9 +4286,12 @@ struct WinMidiData {
   HMIDIIN inHandle;    // Handle to Midi Input Device
   HMIDIOUT outHandle;  // Handle to Midi Output Device
   DWORD lastTime;
-  MidiInApi::MidiMessage message;
+  unsigned long long startTimeNs; // RtMidi::getTimeNs() when the input was started
   LPMIDIHDR sysexBuffer[RT_SYSEX_BUFFER_COUNT];
   CRITICAL_SECTION _mutex; // [Patrice] see https://groups.google.com/forum/#!topic/mididev/6OUjHutMpEo
+  HANDLE watchThread;  // see winmmPortWatchThread()
+  HWND watchWindow;
+  HANDLE watchReady;
 };
 
 //*********************************************************************//
@@ -2455,11 +4312,15 @@ static void CALLBACK midiInputCallback( HMIDIIN /*hmin*/,
   WinMidiData *apiData = static_cast<WinMidiData *> (data->apiData);
 
   // Calculate time stamp.
-  if ( data->firstMessage == true ) {
-    apiData->message.timeStamp = 0.0;
+  double timeStamp = 0.0;
+  if ( data->firstMessage == true )
     data->firstMessage = false;
-  }
-  else apiData->message.timeStamp = (double) ( timestamp - apiData->lastTime ) * 0.001;
+  else timeStamp = (double) ( timestamp - apiData->lastTime ) * 0.001;
+
+  // Short messages are decoded on the stack, sysex reassembled in data->sysex.
+  unsigned char shortMessage[3];
+  const unsigned char *messageBytes;
+  size_t messageSize;
 
   if ( inputStatus == MIM_DATA ) { // Channel or system message
 
@@ -2467,36 +4328,34 @@ static void CALLBACK midiInputCallback( HMIDIIN /*hmin*/,
     unsigned char status = (unsigned char) (midiMessage & 0x000000FF);
     if ( !(status & 0x80) ) return;
 
-    // Determine the number of bytes in the MIDI message.
-    unsigned short nBytes = 1;
-    if ( status < 0xC0 ) nBytes = 3;
-    else if ( status < 0xE0 ) nBytes = 2;
-    else if ( status < 0xF0 ) nBytes = 3;
-    else if ( status == 0xF1 ) {
-      if ( data->ignoreFlags & 0x02 ) return;
-      else nBytes = 2;
-    }
-    else if ( status == 0xF2 ) nBytes = 3;
-    else if ( status == 0xF3 ) nBytes = 2;
-    else if ( status == 0xF8 && ( data->ignoreFlags & 0x02 ) ) {
-      // A MIDI timing tick message and we're ignoring it.
-      return;
-    }
-    else if ( status == 0xFE && ( data->ignoreFlags & 0x04 ) ) {
-      // A MIDI active sensing message and we're ignoring it.
-      return;
-    }
-
-    // Copy bytes to our MIDI message.
-    unsigned char *ptr = (unsigned char *) &midiMessage;
-    for ( int i=0; i<nBytes; ++i ) apiData->message.bytes.push_back( *ptr++ );
+    // Drop the time code, timing tick and active sensing messages we are
+    // ignoring, and look up the number of bytes in the MIDI message.
+    if ( data->ignoreFlags.load( std::memory_order_relaxed ) & MidiInApi::MidiParser::table.ignoreFlag[status] ) return;
+    unsigned short nBytes = MidiInApi::MidiParser::table.length[status];
+
+    // The message is packed in the low bytes of midiMessage, status
+    // first.  Unused bytes are decoded too, only nBytes are delivered.
+    shortMessage[0] = status;
+    shortMessage[1] = (unsigned char) ( ( midiMessage >> 8 ) & 0xFF );
+    shortMessage[2] = (unsigned char) ( ( midiMessage >> 16 ) & 0xFF );
+    messageBytes = shortMessage;
+    messageSize = nBytes;
   }
   else { // Sysex message ( MIM_LONGDATA or MIM_LONGERROR )
     MIDIHDR *sysex = ( MIDIHDR *) midiMessage;
-    if ( !( data->ignoreFlags & 0x01 ) && inputStatus != MIM_LONGERROR ) {
-      // Sysex message and we're not ignoring it
-      for ( int i=0; i<(int)sysex->dwBytesRecorded; ++i )
-        apiData->message.bytes.push_back( sysex->lpData[i] );
+    if ( !( data->ignoreFlags.load( std::memory_order_relaxed ) & 0x01 ) && inputStatus != MIM_LONGERROR ) {
+      // Sysex message and we're not ignoring it.  Messages longer than
+      // RT_SYSEX_BUFFER_SIZE come in several buffers, which are
+      // reassembled in the sysex buffer before it is requeued.
+      const unsigned char *chunk = (const unsigned char *) sysex->lpData;
+      DWORD chunkSize = sysex->dwBytesRecorded;
+      if ( !data->continueSysex ) data->sysex.clear();
+      data->sysex.append( chunk, chunkSize );
+      data->continueSysex = chunkSize > 0 && chunk[chunkSize - 1] != 0xF7;
+    }
+    else {
+      // Ignored or incomplete (MIM_LONGERROR), start over with the next one.
+      data->continueSysex = false;
     }
 
     // The WinMM API requires that the sysex buffer be requeued after
@@ -2513,28 +4372,24 @@ static void CALLBACK midiInputCallback( HMIDIIN /*hmin*/,
       MMRESULT result = midiInAddBuffer( apiData->inHandle, apiData->sysexBuffer[sysex->dwUser], sizeof(MIDIHDR) );
       LeaveCriticalSection( &(apiData->_mutex) );
       if ( result != MMSYSERR_NOERROR )
-        std::cerr << "\nRtMidiIn::midiInputCallback: error sending sysex to Midi device!!\n\n";
+        RTMIDI_LOG_WARN( "\nRtMidiIn::midiInputCallback: error sending sysex to Midi device!!\n\n" );
 
-      if ( data->ignoreFlags & 0x01 ) return;
+      if ( data->ignoreFlags.load( std::memory_order_relaxed ) & 0x01 ) return;
     }
     else return;
+
+    // Wait for the end of a segmented sysex, and drop the ones that had
+    // an error or did not fit.
+    if ( inputStatus == MIM_LONGERROR || data->continueSysex || data->sysex.overflow ) return;
+    messageBytes = data->sysex.bytes.data();
+    messageSize = data->sysex.size;
   }
 
   // Save the time of the last non-filtered message
   apiData->lastTime = timestamp;
 
-  if ( data->usingCallback ) {
-    RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) data->userCallback;
-    callback( apiData->message.timeStamp, &apiData->message.bytes, data->userData );
-  }
-  else {
-    // As long as we haven't reached our queue size limit, push the message.
-    if ( !data->queue.push( apiData->message ) )
-      std::cerr << "\nMidiInWinMM: message queue limit reached!!\n\n";
-  }
-
-  // Clear the vector for the next input message.
-  apiData->message.bytes.clear();
+  // timestamp is in milliseconds since midiInStart().
+  data->dispatch( messageBytes, messageSize, timeStamp, apiData->startTimeNs + (unsigned long long) timestamp * 1000000 );
 }
 
 MidiInWinMM :: MidiInWinMM( const std::string &clientName, unsigned int queueSizeLimit )
@@ -2547,6 +4402,7 @@ MidiInWinMM :: ~MidiInWinMM()
 {
   // Close a connection if it exists.
   MidiInWinMM::closePort();
+  stopPortWatch();
 
   WinMidiData *data = static_cast<WinMidiData *> (apiData_);
   DeleteCriticalSection( &(data->_mutex) );
@@ -2569,7 +4425,11 @@ void MidiInWinMM :: initialize( const std::string& /*clientName*/ )
   WinMidiData *data = (WinMidiData *) new WinMidiData;
   apiData_ = (void *) data;
   inputData_.apiData = (void *) data;
-  data->message.bytes.clear();  // needs to be empty for first input message
+  data->startTimeNs = 0;
+
+  data->watchThread = NULL;
+  data->watchWindow = NULL;
+  data->watchReady = NULL;
 
   if ( !InitializeCriticalSectionAndSpinCount( &(data->_mutex), 0x00000400 ) ) {
     errorString_ = "MidiInWinMM::initialize: InitializeCriticalSectionAndSpinCount failed.";
@@ -2577,6 +4437,163 @@ void MidiInWinMM :: initialize( const std::string& /*clientName*/ )
   }
 }
 
+// Returns the name of an input device, as listed by getPortName().
+static std::string winmmInputPortName( unsigned int portNumber )
+{
+  MIDIINCAPS deviceCaps;
+  midiInGetDevCaps( portNumber, &deviceCaps, sizeof(MIDIINCAPS));
+  std::string stringName = ConvertToUTF8( deviceCaps.szPname );
+
+  // Next lines added to add the portNumber to the name so that
+  // the device's names are sure to be listed with individual names
+  // even when they have the same brand name
+#ifndef RTMIDI_DO_NOT_ENSURE_UNIQUE_PORTNAMES
+  std::ostringstream os;
+  os << " ";
+  os << portNumber;
+  stringName += os.str();
+#endif
+
+  return stringName;
+}
+
+// Enumerates the input devices again and updates the port list cache.
+// WinMM may only list a device shortly after its interface arrival is
+// notified, so a list identical to the cached one is checked again a
+// few times.
+static void winmmRefreshPortList( MidiInApi::RtMidiInData *data, bool retry )
+{
+  std::vector<std::string> names;
+  for ( int attempt = 0; attempt < 10; ++attempt ) {
+    if ( attempt > 0 ) Sleep( 50 );
+    names.clear();
+    unsigned int nDevices = midiInGetNumDevs();
+    for ( unsigned int i=0; i<nDevices; ++i )
+      names.push_back( winmmInputPortName( i ) );
+    if ( !retry || !data->portList.matches( names ) ) break;
+  }
+
+  data->portList.update( names );
+}
+
+static LRESULT CALLBACK winmmPortWatchProc( HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam )
+{
+  switch ( message ) {
+  case WM_DEVICECHANGE:
+    if ( wParam == DBT_DEVICEARRIVAL || wParam == DBT_DEVICEREMOVECOMPLETE ) {
+      MidiInApi::RtMidiInData *data = (MidiInApi::RtMidiInData *) GetWindowLongPtrA( hwnd, GWLP_USERDATA );
+      if ( data ) winmmRefreshPortList( data, true );
+    }
+    return TRUE;
+
+  case WM_CLOSE:
+    DestroyWindow( hwnd );
+    return 0;
+
+  case WM_DESTROY:
+    PostQuitMessage( 0 );
+    return 0;
+  }
+
+  return DefWindowProcA( hwnd, message, wParam, lParam );
+}
+
+// KSCATEGORY_AUDIO from ks.h, the interface class of the kernel streaming
+// audio devices, MIDI ones included.  Defined here so that the Windows
+// Driver Kit headers are not needed.
+static const GUID winmmAudioInterfaceClass =
+  { 0x6994AD04, 0x93EF, 0x11D0, { 0xA3, 0xCC, 0x00, 0xA0, 0xC9, 0x22, 0x31, 0x96 } };
+
+// Owns a hidden message-only window registered for the audio device
+// interface notifications, and sleeps in its message loop until the
+// devices change.  Other devices (storage, HID...) do not wake it up.
+static DWORD WINAPI winmmPortWatchThread( LPVOID ptr )
+{
+  MidiInApi::RtMidiInData *data = static_cast<MidiInApi::RtMidiInData *> (ptr);
+  WinMidiData *apiData = static_cast<WinMidiData *> (data->apiData);
+
+  // The class is shared by all the instances and stays registered.
+  HINSTANCE instance = GetModuleHandleA( NULL );
+  WNDCLASSEXA windowClass = {};
+  windowClass.cbSize = sizeof( windowClass );
+  windowClass.lpfnWndProc = winmmPortWatchProc;
+  windowClass.hInstance = instance;
+  windowClass.lpszClassName = "RtMidiPortWatch";
+  RegisterClassExA( &windowClass );
+
+  HDEVNOTIFY notification = NULL;
+  HWND window = CreateWindowExA( 0, "RtMidiPortWatch", "", 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, instance, NULL );
+  if ( window ) {
+    SetWindowLongPtrA( window, GWLP_USERDATA, (LONG_PTR) data );
+    DEV_BROADCAST_DEVICEINTERFACE_A filter = {};
+    filter.dbcc_size = sizeof( filter );
+    filter.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
+    filter.dbcc_classguid = winmmAudioInterfaceClass;
+    notification = RegisterDeviceNotificationA( window, &filter, DEVICE_NOTIFY_WINDOW_HANDLE );
+    if ( !notification ) {
+      DestroyWindow( window );
+      window = NULL;
+    }
+  }
+
+  apiData->watchWindow = window;
+  SetEvent( apiData->watchReady );
+  if ( !window ) return 0;
+
+  // Catch a device that arrived before the registration.
+  winmmRefreshPortList( data, false );
+
+  MSG message;
+  while ( GetMessageA( &message, NULL, 0, 0 ) > 0 )
+    DispatchMessageA( &message );
+
+  UnregisterDeviceNotification( notification );
+  return 0;
+}
+
+void MidiInWinMM :: watchPortList( void )
+{
+  WinMidiData *data = static_cast<WinMidiData *> (apiData_);
+  if ( data && !data->watchThread ) startPortWatch();
+}
+
+// Starts the port list cache, kept up to date by winmmPortWatchThread().
+// On failure, the devices are enumerated on each query instead.
+void MidiInWinMM :: startPortWatch( void )
+{
+  WinMidiData *data = static_cast<WinMidiData *> (apiData_);
+
+  winmmRefreshPortList( &inputData_, false );
+
+  data->watchReady = CreateEvent( NULL, TRUE, FALSE, NULL );
+  if ( data->watchReady )
+    data->watchThread = CreateThread( NULL, 0, winmmPortWatchThread, &inputData_, 0, NULL );
+  if ( data->watchThread ) WaitForSingleObject( data->watchReady, INFINITE );
+  if ( data->watchReady ) CloseHandle( data->watchReady );
+  data->watchReady = NULL;
+
+  if ( !data->watchWindow ) {
+    errorString_ = "MidiInWinMM::startPortWatch: error registering for device notifications, port changes will not be notified.";
+    error( RtMidiError::WARNING, errorString_ );
+    return;
+  }
+
+  inputData_.portList.enabled = true;
+}
+
+void MidiInWinMM :: stopPortWatch( void )
+{
+  WinMidiData *data = static_cast<WinMidiData *> (apiData_);
+  if ( !data->watchThread ) return;
+
+  inputData_.portList.enabled = false;
+  if ( data->watchWindow ) PostMessageA( data->watchWindow, WM_CLOSE, 0, 0 );
+  WaitForSingleObject( data->watchThread, INFINITE );
+  CloseHandle( data->watchThread );
+  data->watchThread = NULL;
+  data->watchWindow = NULL;
+}
+
 void MidiInWinMM :: openPort( unsigned int portNumber, const std::string &/*portName*/ )
 {
   if ( connected_ ) {
@@ -2640,6 +4657,8 @@ void MidiInWinMM :: openPort( unsigned int portNumber, const std::string &/*port
     }
   }
 
+  inputData_.continueSysex = false;
+  data->startTimeNs = RtMidi::getTimeNs();
   result = midiInStart( data->inHandle );
   if ( result != MMSYSERR_NOERROR ) {
     midiInClose( data->inHandle );
@@ -2705,12 +4724,17 @@ void MidiInWinMM :: setPortName ( const std::string& )
 
 unsigned int MidiInWinMM :: getPortCount()
 {
+  if ( inputData_.portList.enabled ) return inputData_.portList.count();
+
   return midiInGetNumDevs();
 }
 
 std::string MidiInWinMM :: getPortName( unsigned int portNumber )
 {
   std::string stringName;
+  if ( inputData_.portList.enabled && inputData_.portList.name( portNumber, stringName ) )
+    return stringName;
+
   unsigned int nDevices = midiInGetNumDevs();
   if ( portNumber >= nDevices ) {
     std::ostringstream ost;
@@ -2720,20 +4744,7 @@ std::string MidiInWinMM :: getPortName( unsigned int portNumber )
     return stringName;
   }
 
-  MIDIINCAPS deviceCaps;
-  midiInGetDevCaps( portNumber, &deviceCaps, sizeof(MIDIINCAPS));
-  stringName = ConvertToUTF8( deviceCaps.szPname );
-
-  // Next lines added to add the portNumber to the name so that
-  // the device's names are sure to be listed with individual names
-  // even when they have the same brand name
-#ifndef RTMIDI_DO_NOT_ENSURE_UNIQUE_PORTNAMES
-  std::ostringstream os;
-  os << " ";
-  os << portNumber;
-  stringName += os.str();
-#endif
-
+  stringName = winmmInputPortName( portNumber );
   return stringName;
 }
 
@@ -3009,7 +5020,7 @@ static int jackProcessIn( jack_nframes_t nframes, void *arg )
 
   void *buff = jack_port_get_buffer( jData->port, nframes );
   bool& continueSysex = rtData->continueSysex;
-  unsigned char& ignoreFlags = rtData->ignoreFlags;
+  unsigned char ignoreFlags = rtData->ignoreFlags.load( std::memory_order_relaxed );
 
   // We have midi events in buffer
   int evCount = jack_midi_get_event_count( buff );
@@ -3064,15 +5075,7 @@ static int jackProcessIn( jack_nframes_t nframes, void *arg )
     if ( !continueSysex ) {
       // If not a continuation of a SysEx message,
       // invoke the user callback function or queue the message.
-      if ( rtData->usingCallback ) {
-        RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) rtData->userCallback;
-        callback( message.timeStamp, &message.bytes, rtData->userData );
-      }
-      else {
-        // As long as we haven't reached our queue size limit, push the message.
-        if ( !rtData->queue.push( message ) )
-          std::cerr << "\nMidiInJack: message queue limit reached!!\n\n";
-      }
+      rtData->dispatch( message.bytes.data(), message.bytes.size(), message.timeStamp, time * 1000 );
     }
   }
 
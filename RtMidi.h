@@ -60,6 +60,20 @@
 
 #define RTMIDI_VERSION "4.0.0"
 
+// Used to keep the input queue indexes written by different threads apart.
+#define RTMIDI_CACHE_LINE_SIZE 64
+
+// Maximum number of messages and of bytes collected by the input thread
+// before a batch is delivered.
+#define RTMIDI_BATCH_MESSAGES 64
+#define RTMIDI_BATCH_BYTES 4096
+
+// Default size of the buffer in which input sysex messages are reassembled.
+#define RTMIDI_SYSEX_MAX_SIZE 65536
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <exception>
 #include <iostream>
 #include <string>
@@ -140,6 +154,8 @@ class RTMIDI_DLL_PUBLIC RtMidi
     UNIX_JACK,      /*!< The JACK Low-Latency MIDI Server API. */
     WINDOWS_MM,     /*!< The Microsoft Multimedia MIDI API. */
     RTMIDI_DUMMY,   /*!< A compilable but non-functional API. */
+    LINUX_ALSA_RAW, /*!< The ALSA rawmidi API, reading hardware devices directly (input only). */
+    LINUX_ALSA_SHARED, /*!< The ALSA sequencer API, with one client and input thread for all the instances (input only). */
     NUM_APIS        /*!< Number of values in this enum. */
   };
 
@@ -177,6 +193,15 @@ class RTMIDI_DLL_PUBLIC RtMidi
   */
   static RtMidi::Api getCompiledApiByName( const std::string &name );
 
+  //! Return the current time of the input timestamp clock, in nanoseconds.
+  /*!
+    This is std::chrono::steady_clock, which is CLOCK_MONOTONIC on
+    Linux, QueryPerformanceCounter on Windows and mach_absolute_time on
+    macOS.  The backends map the input timestamps onto this clock, with
+    the offset and resolution listed for RtMidiRawCallback.
+  */
+  static unsigned long long getTimeNs( void );
+
   //! Pure virtual openPort() function.
   virtual void openPort( unsigned int portNumber = 0, const std::string &portName = std::string( "RtMidi" ) ) = 0;
 
@@ -252,6 +277,112 @@ class RTMIDI_DLL_PUBLIC RtMidiIn : public RtMidi
   //! User callback function type definition.
   typedef void (*RtMidiCallback)( double timeStamp, std::vector<unsigned char> *message, void *userData );
 
+  //! Raw user callback function type definition.
+  /*!
+    \e message points to \e size bytes owned by the backend, only valid
+    during the call.  \e timeStamp is the absolute arrival time of the
+    message in nanoseconds, mapped onto the clock of RtMidi::getTimeNs()
+    as follows:
+    - CoreMIDI: host time, the same clock, in nanoseconds.
+    - ALSA rawmidi: RtMidi::getTimeNs() when the bytes are read.
+    - ALSA sequencer (and shared client): the real time of the input
+      queue, in nanoseconds, plus RtMidi::getTimeNs() read just after
+      the queue was started.  Constant offset of that start latency,
+      usually a few microseconds late.
+    - WinMM: the millisecond timestamp of the driver, counted by
+      timeGetTime() from midiInStart(), plus RtMidi::getTimeNs() read
+      just before it.  Millisecond resolution, and the two clocks drift
+      apart during long sessions.
+    - JACK: jack_get_time(), in microseconds, on the clock of the JACK
+      server, which is only CLOCK_MONOTONIC with some servers: it may
+      not be comparable with RtMidi::getTimeNs() at all.
+  */
+  typedef void (*RtMidiRawCallback)( unsigned long long timeStamp, const unsigned char *message, size_t size, void *userData );
+
+  //! A message handed to a batch callback.
+  struct MessageView {
+    const unsigned char *bytes;    /*!< Message bytes, only valid during the call. */
+    size_t size;                   /*!< Number of bytes. */
+    double deltaTime;              /*!< Seconds since the previous message, as for RtMidiCallback. */
+    unsigned long long timeStamp;  /*!< Absolute nanoseconds, as for RtMidiRawCallback. */
+  };
+
+  //! Batch user callback function type definition.
+  /*!
+    Receives all the messages decoded during one wakeup of the input
+    thread, in arrival order.  Backends without batching (all but ALSA)
+    deliver batches of a single message.
+  */
+  typedef void (*RtMidiBatchCallback)( const MessageView *messages, size_t count, void *userData );
+
+  //! Queue overflow callback function type definition.
+  /*!
+    Called from the MIDI input thread the first time a message has to be
+    dropped because the input queue is full.  \e queueSize is the size
+    the queue was created with.
+  */
+  typedef void (*RtMidiQueueOverflowCallback)( unsigned int queueSize, void *userData );
+
+  //! Port list change callback function type definition.
+  /*!
+    Called when input ports appear or disappear, with the new value of
+    getPortListGeneration().  See setPortListCallback().
+  */
+  typedef void (*RtMidiPortListCallback)( unsigned long long generation, void *userData );
+
+  //! Input queue statistics, see getQueueStats().
+  struct QueueStats {
+    unsigned long long pushes;   /*!< Messages stored in the queue. */
+    unsigned long long pops;     /*!< Messages retrieved with getMessage(). */
+    unsigned long long drops;    /*!< Messages dropped because the queue was full, the newest or the oldest ones. */
+    unsigned long long coalesced; /*!< Control changes merged into a queued one, see QUEUE_COALESCE_CC. */
+    unsigned int maxDepth;       /*!< Highest number of messages held at once. */
+    unsigned int depth;          /*!< Number of messages currently held. */
+    unsigned int capacity;       /*!< Maximum number of messages the queue can hold. */
+  };
+
+  //! What to do with a message arriving when the input queue is full, see setQueueOverflowPolicy().
+  enum QueueOverflowPolicy {
+    QUEUE_DROP_NEWEST,  /*!< Drop the arriving message (default). */
+    QUEUE_DROP_OLDEST,  /*!< Drop the oldest queued message to make room. */
+    QUEUE_COALESCE_CC   /*!< A control change of a controller given to setCoalescedControllers()
+                             replaces the value and the timestamp of a queued one with the same
+                             channel and controller, keeping its place.  Its delta time grows
+                             accordingly, the delta of the message queued after it is left
+                             unchanged.  Other messages are dropped as with QUEUE_DROP_NEWEST. */
+  };
+
+  //! Scheduling policies for the input thread, see setThreadOptions().
+  enum ThreadPolicy {
+    THREAD_POLICY_DEFAULT,  /*!< Normal time-sharing scheduling (SCHED_OTHER). */
+    THREAD_POLICY_FIFO,     /*!< Real-time first-in first-out (SCHED_FIFO). */
+    THREAD_POLICY_RR        /*!< Real-time round-robin (SCHED_RR). */
+  };
+
+  //! Requested scheduling options for the input thread.
+  struct ThreadOptions {
+    ThreadPolicy policy;  /*!< Scheduling policy. */
+    int priority;         /*!< Real-time priority, 1 (lowest) to 99 (highest), ignored for the default policy. */
+    int cpu;              /*!< CPU the thread is pinned to, or -1 for no affinity. */
+    bool lockMemory;      /*!< Lock the process memory (mlockall) so that the input path never page faults.  The lock is shared by all inputs and released with the last one. */
+
+    // Default constructor: nothing requested.
+    ThreadOptions()
+      : policy(THREAD_POLICY_DEFAULT), priority(0), cpu(-1), lockMemory(false) {}
+  };
+
+  //! Scheduling options actually in effect for the input thread, see getThreadStatus().
+  struct ThreadStatus {
+    ThreadPolicy policy;  /*!< Scheduling policy. */
+    int priority;         /*!< Real-time priority, 0 for the default policy. */
+    int cpu;              /*!< CPU the thread is pinned to, or -1. */
+    bool memoryLocked;    /*!< True if the process memory is locked. */
+
+    // Default constructor: nothing granted.
+    ThreadStatus()
+      : policy(THREAD_POLICY_DEFAULT), priority(0), cpu(-1), memoryLocked(false) {}
+  };
+
   //! Default constructor that allows an optional api, client name and queue size.
   /*!
     An exception will be thrown if a MIDI system initialization
@@ -313,6 +444,32 @@ class RTMIDI_DLL_PUBLIC RtMidiIn : public RtMidi
   */
   void setCallback( RtMidiCallback callback, void *userData = 0 );
 
+  //! Set a raw callback function to be invoked for incoming MIDI messages.
+  /*!
+    Same as setCallback(), but the message is handed over as a pointer
+    and a length into the backend's decoding buffer, so that no vector
+    has to be filled for each message.  Only one of the two callback
+    kinds can be set at a time.
+
+    \param callback A callback function must be given.
+    \param userData Optionally, a pointer to additional data can be
+                    passed to the callback function whenever it is called.
+  */
+  void setRawCallback( RtMidiRawCallback callback, void *userData = 0 );
+
+  //! Set a batch callback function to be invoked for incoming MIDI messages.
+  /*!
+    Same as setRawCallback(), but the backend drains every pending
+    event when it wakes up and delivers them in one call, which cuts the
+    per-message overhead during dense controller traffic.  Only one
+    callback kind can be set at a time.
+
+    \param callback A callback function must be given.
+    \param userData Optionally, a pointer to additional data can be
+                    passed to the callback function whenever it is called.
+  */
+  void setBatchCallback( RtMidiBatchCallback callback, void *userData = 0 );
+
   //! Cancel use of the current callback function (if one exists).
   /*!
     Subsequent incoming MIDI messages will be written to the queue
@@ -344,6 +501,31 @@ class RTMIDI_DLL_PUBLIC RtMidiIn : public RtMidi
   */
   std::string getPortName( unsigned int portNumber = 0 );
 
+  //! Return a counter incremented each time the list of input ports changes.
+  /*!
+    With the ALSA sequencer and WinMM APIs, once setPortListCallback()
+    was given a callback, the port list is cached and kept up to date by
+    a notification thread (ALSA System:Announce events, WinMM device
+    interface arrival and removal), so that this function,
+    getPortCount() and getPortName() only read the cache.  Otherwise,
+    the ports are enumerated on each call of this function, and the
+    counter is incremented when the list differs from the previous call.
+  */
+  unsigned long long getPortListGeneration( void );
+
+  //! Set a function to be invoked when the list of input ports changes.
+  /*!
+    With the ALSA sequencer and WinMM APIs, the first callback set
+    starts the notification thread of this instance, and the callback is
+    invoked from it as soon as the cached list was updated.  Only the
+    instance listing the ports needs one: the thread costs a sequencer
+    client (ALSA) or a hidden window registered for all the device
+    notifications (WinMM).  With the other APIs, the callback is only
+    invoked from getPortListGeneration().  Pass a null callback to
+    remove it, the thread keeps running until the instance is deleted.
+  */
+  void setPortListCallback( RtMidiPortListCallback callback, void *userData = 0 );
+
   //! Specify whether certain MIDI message types should be queued or ignored during input.
   /*!
     By default, MIDI timing and active sensing messages are ignored
@@ -354,6 +536,29 @@ class RTMIDI_DLL_PUBLIC RtMidiIn : public RtMidi
   */
   void ignoreTypes( bool midiSysex = true, bool midiTime = true, bool midiSense = true );
 
+  //! Channel message kinds, for acceptChannelMessages().
+  enum ChannelMessageKind {
+    NOTE_OFF = 0x01,           /*!< 0x8n */
+    NOTE_ON = 0x02,            /*!< 0x9n */
+    POLY_PRESSURE = 0x04,      /*!< 0xAn, polyphonic aftertouch */
+    CONTROL_CHANGE = 0x08,     /*!< 0xBn */
+    PROGRAM_CHANGE = 0x10,     /*!< 0xCn */
+    CHANNEL_PRESSURE = 0x20,   /*!< 0xDn, channel aftertouch */
+    PITCH_BEND = 0x40,         /*!< 0xEn */
+    ALL_CHANNEL_MESSAGES = 0x7F
+  };
+
+  //! Specify which channel message kinds should be queued, the others are ignored during input.
+  /*!
+    All of them are accepted by default.  With the ALSA sequencer API,
+    this and the ignoreTypes() settings are installed as a client event
+    filter, so that ignored events are dropped by the kernel and never
+    wake the input thread.  The other APIs drop them on input.
+
+    \param kinds A combination of ChannelMessageKind values.
+  */
+  void acceptChannelMessages( unsigned int kinds = ALL_CHANNEL_MESSAGES );
+
   //! Fill the user-provided vector with the data bytes for the next available MIDI message in the input queue and return the event delta-time in seconds.
   /*!
     This function returns immediately whether a new message is
@@ -364,6 +569,79 @@ class RTMIDI_DLL_PUBLIC RtMidiIn : public RtMidi
   */
   double getMessage( std::vector<unsigned char> *message );
 
+  //! Same as getMessage( message ), also returning the absolute timestamp of the message.
+  /*!
+    \e timeStamp receives the arrival time of the message in nanoseconds,
+    on the clock of RtMidi::getTimeNs().  It is left untouched if no
+    message is available.
+  */
+  double getMessage( std::vector<unsigned char> *message, unsigned long long *timeStamp );
+
+  //! Set the maximum size of input sysex messages.
+  /*!
+    Sysex messages are reassembled in a buffer allocated once with this
+    size (RTMIDI_SYSEX_MAX_SIZE bytes by default), so that receiving
+    them does not allocate.  Longer messages are dropped with a warning.
+    The buffer is only allocated while sysex messages are not ignored
+    (see ignoreTypes()).  This function must be called while no port is
+    open.
+  */
+  void setSysexBufferSize( unsigned int size );
+
+  //! Return a snapshot of the input queue counters.
+  /*!
+    The counters are updated by the input thread with atomic operations,
+    so this function can be called at any time from any thread.  They
+    only move when no callback is set, since messages are otherwise
+    handed directly to the callback.
+  */
+  QueueStats getQueueStats( void );
+
+  //! Reset the input queue counters and re-arm the overflow callback.
+  void resetQueueStats( void );
+
+  //! Set a function to be invoked on the first input queue overflow.
+  /*!
+    Without an overflow callback, a warning is printed instead.  Further
+    overflows are only counted (see getQueueStats()) until
+    resetQueueStats() is called.
+  */
+  void setQueueOverflowCallback( RtMidiQueueOverflowCallback callback, void *userData = 0 );
+
+  //! Choose what happens to the messages arriving when the input queue is full.
+  /*!
+    The queue size is the \e queueSizeLimit given to the constructor.
+    Like the queue itself, the policy only matters when no callback is
+    set.  The queue stays lock-free with every policy: with the overflow
+    policies, getMessage() claims each message with a compare-and-swap,
+    as the input thread may evict or merge queued messages.
+  */
+  void setQueueOverflowPolicy( QueueOverflowPolicy policy );
+
+  //! Set the controllers whose control changes QUEUE_COALESCE_CC may merge.
+  /*!
+    Only controllers carrying an absolute value can be merged without
+    losing anything: merging the press and release of a button, or the
+    steps of a relative encoder, loses events.  None by default.  Cannot
+    be changed while a port is open.
+  */
+  void setCoalescedControllers( const std::vector<unsigned char> &controllers );
+
+  //! Request real-time scheduling, CPU affinity and memory locking for the input thread.
+  /*!
+    The options are applied when the input thread is started by
+    openPort() or openVirtualPort(), or immediately if it is already
+    running.  Each option that cannot be granted (usually for lack of
+    privileges, see RLIMIT_RTPRIO and RLIMIT_MEMLOCK) is skipped with a
+    warning, the others still apply.  Check getThreadStatus() for what
+    was granted.  Currently only supported by the ALSA API, the other
+    APIs do not own their input thread.
+  */
+  void setThreadOptions( const ThreadOptions &options );
+
+  //! Return the scheduling options in effect for the input thread.
+  ThreadStatus getThreadStatus( void );
+
   //! Set an error callback function to be invoked when an error has occured.
   /*!
     The callback function will be called whenever an error has occured. It is best
@@ -392,6 +670,12 @@ class RTMIDI_DLL_PUBLIC RtMidiIn : public RtMidi
 class RTMIDI_DLL_PUBLIC RtMidiOut : public RtMidi
 {
  public:
+  //! A message handed to sendMessages().
+  struct Message {
+    const unsigned char *bytes;    /*!< Message bytes. */
+    size_t size;                   /*!< Number of bytes. */
+  };
+
   //! Default constructor that allows an optional client name.
   /*!
     An exception will be thrown if a MIDI system initialization error occurs.
@@ -467,6 +751,19 @@ class RTMIDI_DLL_PUBLIC RtMidiOut : public RtMidi
   */
   void sendMessage( const unsigned char *message, size_t size );
 
+  //! Immediately send several messages out an open MIDI output port, in order.
+  /*!
+      Same as calling sendMessage() for each message, but the ALSA
+      backend flushes its output once for the whole batch and the
+      CoreMIDI backend sends its short messages in one packet list.
+      Other backends send the messages one by one.  Errors are reported
+      as by sendMessage(), for each message.
+
+      \param messages Array of messages
+      \param count    Number of messages
+  */
+  void sendMessages( const Message *messages, size_t count );
+
   //! Set an error callback function to be invoked when an error has occured.
   /*!
     The callback function will be called whenever an error has occured. It is best
@@ -532,9 +829,22 @@ class RTMIDI_DLL_PUBLIC MidiInApi : public MidiApi
   MidiInApi( unsigned int queueSizeLimit );
   virtual ~MidiInApi( void );
   void setCallback( RtMidiIn::RtMidiCallback callback, void *userData );
+  void setRawCallback( RtMidiIn::RtMidiRawCallback callback, void *userData );
+  void setBatchCallback( RtMidiIn::RtMidiBatchCallback callback, void *userData );
   void cancelCallback( void );
   virtual void ignoreTypes( bool midiSysex, bool midiTime, bool midiSense );
-  double getMessage( std::vector<unsigned char> *message );
+  virtual void acceptChannelMessages( unsigned int kinds );
+  double getMessage( std::vector<unsigned char> *message, unsigned long long *timeStamp = 0 );
+  RtMidiIn::QueueStats getQueueStats( void );
+  void resetQueueStats( void );
+  void setQueueOverflowCallback( RtMidiIn::RtMidiQueueOverflowCallback callback, void *userData );
+  void setQueueOverflowPolicy( RtMidiIn::QueueOverflowPolicy policy );
+  void setCoalescedControllers( const std::vector<unsigned char> &controllers );
+  virtual void setThreadOptions( const RtMidiIn::ThreadOptions &options );
+  void setSysexBufferSize( unsigned int size );
+  RtMidiIn::ThreadStatus getThreadStatus( void ) { return threadStatus_; }
+  unsigned long long getPortListGeneration( void );
+  void setPortListCallback( RtMidiIn::RtMidiPortListCallback callback, void *userData );
 
   // A MIDI structure used internally by the class to store incoming
   // messages.  Each message represents one and only one MIDI message.
@@ -549,18 +859,130 @@ class RTMIDI_DLL_PUBLIC MidiInApi : public MidiApi
       : bytes(0), timeStamp(0.0) {}
   };
 
+  // One entry of the input queue.  Short messages (up to 3 bytes) are
+  // stored inline.  Longer ones (sysex) go to a side buffer owned by the
+  // slot, which keeps its capacity so that the input thread stops
+  // allocating once the queue has warmed up.
+  struct QueueSlot {
+    unsigned char shortBytes[3];
+    unsigned int size;
+    std::vector<unsigned char> longBytes;
+    double timeStamp;
+    unsigned long long timeStampNs;
+
+    // Default constructor.
+    QueueSlot()
+      : size(0), timeStamp(0.0), timeStampNs(0) {}
+    const unsigned char *bytes( void ) const { return size <= sizeof(shortBytes) ? shortBytes : longBytes.data(); }
+  };
+
+  // Single producer (the input thread) / single consumer (getMessage)
+  // lock-free ring.  The producer owns back, the consumer owns front,
+  // each publishes its index with a release store.  The indexes live on
+  // separate cache lines so that both sides do not keep invalidating
+  // each other's line.  With QUEUE_DROP_NEWEST that is all.  The other
+  // policies let the producer evict the front slot (a compare-and-swap
+  // on front, which the consumer also uses to claim the slot it copied)
+  // or rewrite a queued slot.  The consumer announces the slot it copies
+  // in reading and the producer the slot it rewrites in rewriting, so
+  // that neither writes a slot the other is reading.  The producer never
+  // waits for the consumer.
   struct MidiQueue {
-    unsigned int front;
-    unsigned int back;
+    std::atomic<unsigned int> front;
+    char frontPadding[RTMIDI_CACHE_LINE_SIZE - sizeof(std::atomic<unsigned int>)];
+    std::atomic<unsigned int> back;
+    char backPadding[RTMIDI_CACHE_LINE_SIZE - sizeof(std::atomic<unsigned int>)];
     unsigned int ringSize;
-    MidiMessage *ring;
+    QueueSlot *ring;
+
+    // Statistics, written by the input thread (pops by the reader) and
+    // readable from any thread.
+    std::atomic<unsigned long long> pushes;
+    std::atomic<unsigned long long> pops;
+    std::atomic<unsigned long long> drops;
+    std::atomic<unsigned int> maxDepth;
+    std::atomic<unsigned long long> coalesced;
+    RtMidiIn::RtMidiQueueOverflowCallback overflowCallback;
+    void *overflowUserData;
+    RtMidiIn::QueueOverflowPolicy policy;
+    bool coalescedControllers[128];
+    std::atomic<unsigned int> reading;
+    std::atomic<unsigned int> rewriting;
+
+    // Value of reading and rewriting when no slot is announced.
+    static const unsigned int noSlot = (unsigned int) -1;
+
+    // Outcome of overflow() for the arriving message.
+    enum Overflow { ROOM_FREE, OLDEST_DROPPED, COALESCED, NEWEST_DROPPED };
 
     // Default constructor.
     MidiQueue()
-      : front(0), back(0), ringSize(0), ring(0) {}
-    bool push( const MidiMessage& );
-    bool pop( std::vector<unsigned char>*, double* );
+      : front(0), back(0), ringSize(0), ring(0), pushes(0), pops(0), drops(0), maxDepth(0), coalesced(0),
+        overflowCallback(0), overflowUserData(0), policy(RtMidiIn::QUEUE_DROP_NEWEST), reading(noSlot), rewriting(noSlot)
+    { std::fill( coalescedControllers, coalescedControllers + 128, false ); }
+    bool push( const unsigned char *message, size_t size, double timeStamp, unsigned long long timeStampNs );
+    size_t push( const RtMidiIn::MessageView *messages, size_t count );
+    bool pop( std::vector<unsigned char>*, double*, unsigned long long *timeStampNs=0 );
     unsigned int size( unsigned int *back=0, unsigned int *front=0 );
+    Overflow overflow( const RtMidiIn::MessageView &message, unsigned int &_size );
+    Overflow coalesce( const RtMidiIn::MessageView &message, unsigned int &_size );
+    void copySlot( unsigned int index, std::vector<unsigned char> *msg, double *timeStamp, unsigned long long *timeStampNs );
+  };
+
+  // Messages decoded by the input thread during one wakeup.  Their bytes
+  // are copied into the batch since backends reuse their decode buffer.
+  struct MessageBatch {
+    RtMidiIn::MessageView messages[RTMIDI_BATCH_MESSAGES];
+    unsigned char bytes[RTMIDI_BATCH_BYTES];
+    size_t count;
+    size_t used;
+
+    // Default constructor.
+    MessageBatch()
+      : count(0), used(0) {}
+    // Returns false when the batch is full.
+    bool add( const unsigned char *message, size_t size, double deltaTime, unsigned long long timeStamp );
+  };
+
+  // Buffer in which the input thread reassembles sysex messages.  It is
+  // allocated with its capacity when sysex messages stop being ignored,
+  // before the input thread may use it.  A message that does not fit is
+  // dropped.
+  struct SysexBuffer {
+    std::vector<unsigned char> bytes;
+    size_t capacity;
+    size_t size;
+    bool overflow;
+
+    // Default constructor.
+    SysexBuffer()
+      : capacity(RTMIDI_SYSEX_MAX_SIZE), size(0), overflow(false) {}
+    void clear( void ) { size = 0; overflow = false; }
+    void allocate( void ) { if ( bytes.size() != capacity ) bytes.assign( capacity, 0 ); }
+    void append( const unsigned char *data, size_t count );
+  };
+
+  // Cached list of the input port names.  Backends with port change
+  // notifications enable it and update it from their notification
+  // thread, getPortCount() and getPortName() then read it.
+  struct PortListCache {
+    std::mutex mutex;
+    std::vector<std::string> names;
+    bool enabled;
+    std::atomic<unsigned long long> generation;
+    RtMidiIn::RtMidiPortListCallback callback;
+    void *userData;
+
+    // Default constructor.
+    PortListCache()
+      : enabled(false), generation(0), callback(0), userData(0) {}
+    // Replaces the list and notifies the callback if it changed.
+    void update( const std::vector<std::string> &ports );
+    // Returns true if ports is the cached list.
+    bool matches( const std::vector<std::string> &ports );
+    unsigned int count( void );
+    // Returns false if portNumber is out of range.
+    bool name( unsigned int portNumber, std::string &portName );
   };
 
   // The RtMidiInData structure is used to pass private class data to
@@ -568,23 +990,91 @@ class RTMIDI_DLL_PUBLIC MidiInApi : public MidiApi
   struct RtMidiInData {
     MidiQueue queue;
     MidiMessage message;
-    unsigned char ignoreFlags;
+    // Written by the user thread, read by the input thread.
+    std::atomic<unsigned char> ignoreFlags;
+    // RtMidiIn::ChannelMessageKind bits, bit n for status 0x80 + n * 0x10
+    std::atomic<unsigned char> channelKinds;
     bool doInput;
     bool firstMessage;
     void *apiData;
     bool usingCallback;
     RtMidiIn::RtMidiCallback userCallback;
+    RtMidiIn::RtMidiRawCallback rawCallback;
+    RtMidiIn::RtMidiBatchCallback batchCallback;
     void *userData;
     bool continueSysex;
+    SysexBuffer sysex;
+    PortListCache portList;
+    // Reused for the vector callback, so that it only allocates for the
+    // first (or the longest) messages.
+    std::vector<unsigned char> callbackBytes;
 
     // Default constructor.
     RtMidiInData()
-      : ignoreFlags(7), doInput(false), firstMessage(true), apiData(0), usingCallback(false),
-        userCallback(0), userData(0), continueSysex(false) {}
+      : ignoreFlags(7), channelKinds(RtMidiIn::ALL_CHANNEL_MESSAGES), doInput(false), firstMessage(true), apiData(0), usingCallback(false),
+        userCallback(0), rawCallback(0), batchCallback(0), userData(0), continueSysex(false) {}
+
+    // Returns false for channel messages of a kind not accepted.
+    bool accepts( const unsigned char *message ) const
+    { return message[0] < 0x80 || message[0] >= 0xF0 || ( channelKinds.load( std::memory_order_relaxed ) & ( 1 << ( ( message[0] >> 4 ) - 8 ) ) ); }
+    // Hands a complete message to the user callback, or to the queue
+    // when no callback is set.  Called from the input thread.
+    void dispatch( const unsigned char *message, size_t size, double timeStamp, unsigned long long timeStampNs );
+    // Adds a message to the batch, delivering the batch first if it is full.
+    void addToBatch( MessageBatch &batch, const unsigned char *message, size_t size, double timeStamp, unsigned long long timeStampNs );
+    // Delivers the batched messages in one callback or queue publish, and empties the batch.
+    void dispatch( MessageBatch &batch );
+  };
+
+  // Incremental parser for raw MIDI byte streams, for the transports
+  // that have no OS decoder (ALSA rawmidi).  Its state is kept between
+  // calls, so messages may be split across buffers.  It handles running
+  // status, real-time bytes interleaved anywhere and sysex, which is
+  // reassembled in the sysex buffer of the input data.  Bytes are
+  // classified with 256-entry tables indexed by the byte value.
+  struct MidiParser {
+    enum ByteKind {
+      DATA,     // 0x00-0x7F
+      CHANNEL,  // 0x80-0xEF, sets the running status
+      COMMON,   // 0xF1-0xF6, cancels the running status
+      SYSEX,    // 0xF0
+      EOX,      // 0xF7
+      REALTIME  // 0xF8-0xFF
+    };
+    struct ByteTable {
+      unsigned char kind[256];
+      unsigned char length[256];      // message length for a status byte
+      unsigned char ignoreFlag[256];  // ignoreTypes() flag filtering the message
+      ByteTable( void );
+    };
+    static const ByteTable table;
+
+    unsigned char message[3];
+    size_t messageSize;
+    unsigned char runningStatus;
+    bool inSysex;
+    unsigned long long lastTimeNs;
+
+    // Default constructor.
+    MidiParser()
+      : messageSize(0), runningStatus(0), inSysex(false), lastTimeNs(0) {}
+    void reset( void );
+    // Parses a whole buffer received at timeStampNs and adds the complete
+    // messages to the batch.
+    void parse( RtMidiInData &data, MessageBatch &batch, const unsigned char *bytes, size_t size, unsigned long long timeStampNs );
+
+   private:
+    void add( RtMidiInData &data, MessageBatch &batch, const unsigned char *bytes, size_t size, unsigned long long timeStampNs );
   };
 
  protected:
+  // Starts the port list notifications, if the API has some and they
+  // are not running yet.  Called when a port list callback is set.
+  virtual void watchPortList( void ) {}
+
   RtMidiInData inputData_;
+  RtMidiIn::ThreadOptions threadOptions_;
+  RtMidiIn::ThreadStatus threadStatus_;
 };
 
 class RTMIDI_DLL_PUBLIC MidiOutApi : public MidiApi
@@ -594,6 +1084,8 @@ class RTMIDI_DLL_PUBLIC MidiOutApi : public MidiApi
   MidiOutApi( void );
   virtual ~MidiOutApi( void );
   virtual void sendMessage( const unsigned char *message, size_t size ) = 0;
+  // Sends the messages one by one, backends override it to batch them.
+  virtual void sendMessages( const RtMidiOut::Message *messages, size_t count );
 };
 
 // **************************************************************** //
@@ -608,11 +1100,25 @@ inline void RtMidiIn :: openVirtualPort( const std::string &portName ) { rtapi_-
 inline void RtMidiIn :: closePort( void ) { rtapi_->closePort(); }
 inline bool RtMidiIn :: isPortOpen() const { return rtapi_->isPortOpen(); }
 inline void RtMidiIn :: setCallback( RtMidiCallback callback, void *userData ) { static_cast<MidiInApi *>(rtapi_)->setCallback( callback, userData ); }
+inline void RtMidiIn :: setRawCallback( RtMidiRawCallback callback, void *userData ) { static_cast<MidiInApi *>(rtapi_)->setRawCallback( callback, userData ); }
+inline void RtMidiIn :: setBatchCallback( RtMidiBatchCallback callback, void *userData ) { static_cast<MidiInApi *>(rtapi_)->setBatchCallback( callback, userData ); }
 inline void RtMidiIn :: cancelCallback( void ) { static_cast<MidiInApi *>(rtapi_)->cancelCallback(); }
 inline unsigned int RtMidiIn :: getPortCount( void ) { return rtapi_->getPortCount(); }
 inline std::string RtMidiIn :: getPortName( unsigned int portNumber ) { return rtapi_->getPortName( portNumber ); }
 inline void RtMidiIn :: ignoreTypes( bool midiSysex, bool midiTime, bool midiSense ) { static_cast<MidiInApi *>(rtapi_)->ignoreTypes( midiSysex, midiTime, midiSense ); }
+inline void RtMidiIn :: acceptChannelMessages( unsigned int kinds ) { static_cast<MidiInApi *>(rtapi_)->acceptChannelMessages( kinds ); }
 inline double RtMidiIn :: getMessage( std::vector<unsigned char> *message ) { return static_cast<MidiInApi *>(rtapi_)->getMessage( message ); }
+inline double RtMidiIn :: getMessage( std::vector<unsigned char> *message, unsigned long long *timeStamp ) { return static_cast<MidiInApi *>(rtapi_)->getMessage( message, timeStamp ); }
+inline RtMidiIn::QueueStats RtMidiIn :: getQueueStats( void ) { return static_cast<MidiInApi *>(rtapi_)->getQueueStats(); }
+inline void RtMidiIn :: resetQueueStats( void ) { static_cast<MidiInApi *>(rtapi_)->resetQueueStats(); }
+inline void RtMidiIn :: setQueueOverflowPolicy( QueueOverflowPolicy policy ) { static_cast<MidiInApi *>(rtapi_)->setQueueOverflowPolicy( policy ); }
+inline void RtMidiIn :: setCoalescedControllers( const std::vector<unsigned char> &controllers ) { static_cast<MidiInApi *>(rtapi_)->setCoalescedControllers( controllers ); }
+inline void RtMidiIn :: setThreadOptions( const ThreadOptions &options ) { static_cast<MidiInApi *>(rtapi_)->setThreadOptions( options ); }
+inline RtMidiIn::ThreadStatus RtMidiIn :: getThreadStatus( void ) { return static_cast<MidiInApi *>(rtapi_)->getThreadStatus(); }
+inline void RtMidiIn :: setSysexBufferSize( unsigned int size ) { static_cast<MidiInApi *>(rtapi_)->setSysexBufferSize( size ); }
+inline unsigned long long RtMidiIn :: getPortListGeneration( void ) { return static_cast<MidiInApi *>(rtapi_)->getPortListGeneration(); }
+inline void RtMidiIn :: setPortListCallback( RtMidiPortListCallback callback, void *userData ) { static_cast<MidiInApi *>(rtapi_)->setPortListCallback( callback, userData ); }
+inline void RtMidiIn :: setQueueOverflowCallback( RtMidiQueueOverflowCallback callback, void *userData ) { static_cast<MidiInApi *>(rtapi_)->setQueueOverflowCallback( callback, userData ); }
 inline void RtMidiIn :: setErrorCallback( RtMidiErrorCallback errorCallback, void *userData ) { rtapi_->setErrorCallback(errorCallback, userData); }
 
 inline RtMidi::Api RtMidiOut :: getCurrentApi( void ) throw() { return rtapi_->getCurrentApi(); }
@@ -624,6 +1130,7 @@ inline unsigned int RtMidiOut :: getPortCount( void ) { return rtapi_->getPortCo
 inline std::string RtMidiOut :: getPortName( unsigned int portNumber ) { return rtapi_->getPortName( portNumber ); }
 inline void RtMidiOut :: sendMessage( const std::vector<unsigned char> *message ) { static_cast<MidiOutApi *>(rtapi_)->sendMessage( &message->at(0), message->size() ); }
 inline void RtMidiOut :: sendMessage( const unsigned char *message, size_t size ) { static_cast<MidiOutApi *>(rtapi_)->sendMessage( message, size ); }
+inline void RtMidiOut :: sendMessages( const Message *messages, size_t count ) { static_cast<MidiOutApi *>(rtapi_)->sendMessages( messages, count ); }
 inline void RtMidiOut :: setErrorCallback( RtMidiErrorCallback errorCallback, void *userData ) { rtapi_->setErrorCallback(errorCallback, userData); }
 
 #endif
@@ -0,0 +1,80 @@
+// parserbench.cpp : throughput of the RtMidi byte-stream parser (MidiInApi::MidiParser) in bytes per second.
+// Not part of the project, build it on request from this directory:
+//   g++ -O2 -std=c++14 -I.. parserbench.cpp ../RtMidi.cpp -lpthread
+//   cl /O2 /EHsc /I.. parserbench.cpp ..\RtMidi.cpp
+//
+
+#include "RtMidi.h"
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#define BENCH_BUFFER_BYTES	4096
+#define BENCH_TOTAL_BYTES	(256ULL * 1024 * 1024)
+
+static unsigned long long g_deliveredBytes = 0;
+
+static void countBatch(const RtMidiIn::MessageView* messages, size_t count, void* /*userData*/)
+{
+	for (size_t i = 0; i < count; ++i)
+		g_deliveredBytes += messages[i].size;
+}
+
+// Feeds buffer repeatedly to a parser delivering to a batch callback, as the rawmidi input thread does.
+static void bench(const char* name, const std::vector<unsigned char>& buffer)
+{
+	MidiInApi::RtMidiInData data;
+	data.usingCallback = true;
+	data.batchCallback = countBatch;
+	// nothing ignored, the sysex buffer holds a whole message
+	data.ignoreFlags.store(0, std::memory_order_relaxed);
+	data.sysex.capacity = buffer.size();
+	data.sysex.allocate();
+
+	MidiInApi::MidiParser parser;
+	MidiInApi::MessageBatch batch;
+	g_deliveredBytes = 0;
+
+	unsigned long long parsedBytes = 0;
+	auto start = std::chrono::steady_clock::now();
+	while (parsedBytes < BENCH_TOTAL_BYTES)
+	{
+		parser.parse(data, batch, buffer.data(), buffer.size(), parsedBytes);
+		data.dispatch(batch);
+		parsedBytes += buffer.size();
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	printf("%-24s %10.1f MB/s parsed, %llu bytes delivered\n", name, parsedBytes / seconds / 1000000.0, g_deliveredBytes);
+}
+
+int main()
+{
+	// note on, cc and note off with explicit status
+	std::vector<unsigned char> channel;
+	while (channel.size() + 9 <= BENCH_BUFFER_BYTES)
+	{
+		unsigned char value = (unsigned char)(channel.size() & 0x7F);
+		unsigned char messages[] = { 0x90, 60, value, 0xB0, 1, value, 0x80, 60, 0 };
+		channel.insert(channel.end(), messages, messages + sizeof(messages));
+	}
+
+	// the same cc stream with running status
+	std::vector<unsigned char> running(1, 0xB0);
+	while (running.size() + 2 <= BENCH_BUFFER_BYTES)
+	{
+		running.push_back(1);
+		running.push_back((unsigned char)(running.size() & 0x7F));
+	}
+
+	// one sysex message filling the buffer
+	std::vector<unsigned char> sysex(BENCH_BUFFER_BYTES, 0x55);
+	sysex.front() = 0xF0;
+	sysex.back() = 0xF7;
+
+	bench("channel messages", channel);
+	bench("running status", running);
+	bench("sysex", sysex);
+	return 0;
+}
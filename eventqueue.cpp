@@ -0,0 +1,155 @@
+// eventqueue.cpp : merges the MIDI messages of every input into the output stage.
+//
+
+#include "eventqueue.h"
+
+s_eventQueue g_eventQueue;
+
+void s_eventQueue::init(size_t size, e_overflowPolicy overflowPolicy)
+{
+	size_t capacity = 2;
+	while (capacity < size)
+		capacity *= 2;
+
+	cells = std::vector<s_cell>(capacity);
+	for (size_t i = 0; i < capacity; ++i)
+		cells[i].sequence.store(i, std::memory_order_relaxed);
+	mask = capacity - 1;
+	enqueuePos.store(0, std::memory_order_relaxed);
+	dequeuePos.store(0, std::memory_order_relaxed);
+
+	policy = overflowPolicy;
+	drops.store(0, std::memory_order_relaxed);
+	coalesced.store(0, std::memory_order_relaxed);
+}
+
+e_pushResult s_eventQueue::push(const s_midiEvent& event)
+{
+	while (not tryPush(event))
+	{
+		if (policy == OVERFLOW_DROP_NEWEST or (policy == OVERFLOW_COALESCE_CC and not event.coalescible))
+		{
+			drops.fetch_add(1, std::memory_order_relaxed);
+			return PUSH_DROPPED;
+		}
+
+		if (policy == OVERFLOW_COALESCE_CC)
+		{
+			if (not coalesce(event))
+			{
+				drops.fetch_add(1, std::memory_order_relaxed);
+				return PUSH_DROPPED;
+			}
+			coalesced.fetch_add(1, std::memory_order_relaxed);
+			return PUSH_COALESCED;
+		}
+
+		// drop the oldest event and retry, another producer may claim the freed cell first
+		s_midiEvent oldest;
+		bool evicted = take(oldest);
+		drops.fetch_add(1, std::memory_order_relaxed);
+		// the oldest cell is still being written or read by another thread, drop the pushed event instead
+		if (not evicted)
+			return PUSH_DROPPED;
+	}
+
+	return PUSH_STORED;
+}
+
+bool s_eventQueue::tryPush(const s_midiEvent& event)
+{
+	size_t pos = enqueuePos.load(std::memory_order_relaxed);
+	s_cell* cell;
+	while (true)
+	{
+		cell = &cells[pos & mask];
+		size_t sequence = cell->sequence.load(std::memory_order_acquire);
+		ptrdiff_t diff = (ptrdiff_t)sequence - (ptrdiff_t)pos;
+		if (diff == 0)
+		{
+			// the cell is free for this position, claim it
+			if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0)
+		{
+			// the consumer has not freed this cell yet
+			return false;
+		}
+		else
+		{
+			// another producer claimed it first
+			pos = enqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+
+	cell->event = event;
+	cell->sequence.store(pos + 1, std::memory_order_release);
+	return true;
+}
+
+bool s_eventQueue::pop(s_midiEvent& event)
+{
+	// producers only evict or rewrite cells with the other policies
+	if (policy != OVERFLOW_DROP_NEWEST)
+		return take(event);
+
+	size_t pos = dequeuePos.load(std::memory_order_relaxed);
+	s_cell* cell = &cells[pos & mask];
+	size_t sequence = cell->sequence.load(std::memory_order_acquire);
+	if ((ptrdiff_t)sequence - (ptrdiff_t)(pos + 1) < 0)
+		return false;
+
+	event = cell->event;
+	// free the cell for the producer that will wrap around to it
+	cell->sequence.store(pos + mask + 1, std::memory_order_release);
+	dequeuePos.store(pos + 1, std::memory_order_relaxed);
+	return true;
+}
+
+bool s_eventQueue::take(s_midiEvent& event)
+{
+	size_t pos = dequeuePos.load(std::memory_order_acquire);
+	s_cell* cell = &cells[pos & mask];
+	// marking the ready cell as being written again keeps the other takers and the coalescing producers off it
+	size_t ready = pos + 1;
+	if (not cell->sequence.compare_exchange_strong(ready, pos, std::memory_order_acquire, std::memory_order_relaxed))
+		return false;
+
+	event = cell->event;
+	dequeuePos.store(pos + 1, std::memory_order_release);
+	// free the cell for the producer that will wrap around to it
+	cell->sequence.store(pos + mask + 1, std::memory_order_release);
+	return true;
+}
+
+// Merges a coalescible cc into the most recent queued cc of the same input, channel and controller.
+bool s_eventQueue::coalesce(const s_midiEvent& event)
+{
+	size_t first = dequeuePos.load(std::memory_order_acquire);
+	size_t pos = enqueuePos.load(std::memory_order_relaxed);
+	while (pos != first)
+	{
+		--pos;
+		s_cell& cell = cells[pos & mask];
+		// own the cell while comparing and rewriting it. A cell being written, read or rewritten by another
+		// thread stops the search: merging into an older cc past it could let an older value win.
+		size_t ready = pos + 1;
+		if (not cell.sequence.compare_exchange_strong(ready, pos, std::memory_order_acquire, std::memory_order_relaxed))
+			return false;
+
+		s_midiEvent& queued = cell.event;
+		bool merged = queued.input == event.input and queued.size == 3 and queued.bytes[0] == event.bytes[0] and queued.bytes[1] == event.bytes[1];
+		if (merged)
+		{
+			queued.bytes[2] = event.bytes[2];
+			queued.timeStamp = event.timeStamp;
+			queued.arrival = event.arrival;
+		}
+		cell.sequence.store(pos + 1, std::memory_order_release);
+		if (merged)
+			return true;
+	}
+
+	return false;
+}
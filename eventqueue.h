@@ -0,0 +1,87 @@
+// eventqueue.h : merges the MIDI messages of every input into the output stage.
+// Each RtMidi input thread pushes its messages, the main thread pops them and sends the key events,
+// so that the mapping state (alt inputs, virtual numpad) is only ever touched by one thread.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+#include "timing.h"
+
+struct s_input;
+
+#define EVENT_QUEUE_DEFAULT_SIZE	1024
+#define EVENT_CACHE_LINE_SIZE		64
+// longer messages (sysex) are not mapped and never queued
+#define EVENT_MAX_BYTES				3
+
+// what happens to an event pushed into a full queue
+enum e_overflowPolicy
+{
+	OVERFLOW_DROP_NEWEST,	// the pushed event is dropped
+	OVERFLOW_DROP_OLDEST,	// the oldest queued event is dropped to make room
+	OVERFLOW_COALESCE_CC,	// a coalescible cc replaces the value of a queued cc of the same input, channel and controller, other events are dropped
+};
+
+enum e_pushResult
+{
+	PUSH_STORED,
+	PUSH_COALESCED,
+	PUSH_DROPPED,
+};
+
+struct s_midiEvent
+{
+	s_input* input;
+	unsigned long long timeStamp;	// absolute ns, as given by RtMidi
+	t_timePoint arrival;			// when the callback received it, only set for timing analysis and metrics
+	unsigned char size;
+	unsigned char bytes[EVENT_MAX_BYTES];
+	// a cc whose value is absolute for its input, see OVERFLOW_COALESCE_CC
+	bool coalescible;
+};
+
+// Bounded lock-free multi-producer single-consumer queue (Dmitry Vyukov's bounded queue).
+// Every cell carries a sequence number telling whether it is free for the producer owning
+// that position or ready for the consumer, so producers only contend on the enqueue index.
+// When the queue is full, the drop oldest and coalesce policies evict or rewrite ready cells.
+// They own a cell by swapping its sequence from ready back to being written, which the consumer
+// also does before reading a cell with these policies, so the queue stays lock-free.
+struct s_eventQueue
+{
+	struct s_cell
+	{
+		std::atomic<size_t> sequence;
+		s_midiEvent event;
+	};
+
+	std::vector<s_cell> cells;
+	size_t mask = 0;
+
+	char enqueuePadding[EVENT_CACHE_LINE_SIZE];
+	std::atomic<size_t> enqueuePos;
+	char dequeuePadding[EVENT_CACHE_LINE_SIZE];
+	std::atomic<size_t> dequeuePos;
+
+	e_overflowPolicy policy = OVERFLOW_DROP_NEWEST;
+	// events dropped, the pushed or the oldest ones, and cc merged into a queued one
+	std::atomic<unsigned long long> drops;
+	std::atomic<unsigned long long> coalesced;
+
+	// Must be called before any push. size is rounded up to a power of two.
+	void init(size_t size, e_overflowPolicy overflowPolicy);
+	// Any thread.
+	e_pushResult push(const s_midiEvent& event);
+	// Consumer thread only. Returns false if the queue is empty.
+	bool pop(s_midiEvent& event);
+
+	bool tryPush(const s_midiEvent& event);
+	// Claims the oldest cell, racing with the consumer and the other evicting producers.
+	bool take(s_midiEvent& event);
+	bool coalesce(const s_midiEvent& event);
+};
+
+extern s_eventQueue g_eventQueue;
@@ -0,0 +1,21 @@
+// logging.cpp : runtime log level.
+//
+
+#include "logging.h"
+
+std::atomic<int> g_logLevel(LOG_LEVEL_INFO);
+
+int logLevelFromName(const std::string& name)
+{
+	if (name == "trace")
+		return LOG_LEVEL_TRACE;
+	if (name == "debug")
+		return LOG_LEVEL_DEBUG;
+	if (name == "info")
+		return LOG_LEVEL_INFO;
+	if (name == "warn")
+		return LOG_LEVEL_WARN;
+	if (name == "none")
+		return LOG_LEVEL_NONE;
+	return -1;
+}
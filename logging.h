@@ -0,0 +1,63 @@
+// logging.h : leveled logging macros.
+//
+// LOG_TRACE / LOG_DEBUG / LOG_INFO / LOG_WARN take a stream expression, e.g.
+//     LOG_INFO("press " << key.name << "\n");
+// Levels below LOG_COMPILE_LEVEL expand to nothing, so their arguments are never evaluated
+// nor compiled in. Enabled levels cost a single relaxed atomic load before formatting.
+//
+
+#pragma once
+
+#include <atomic>
+#include <iostream>
+#include <string>
+
+#define LOG_LEVEL_TRACE	0
+#define LOG_LEVEL_DEBUG	1
+#define LOG_LEVEL_INFO	2
+#define LOG_LEVEL_WARN	3
+#define LOG_LEVEL_NONE	4
+
+// Can be set from the project file. Release builds drop trace and debug diagnostics by default.
+#ifndef LOG_COMPILE_LEVEL
+#ifdef NDEBUG
+#define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+#else
+#define LOG_COMPILE_LEVEL LOG_LEVEL_TRACE
+#endif
+#endif
+
+// Runtime level, LOG_LEVEL_INFO by default.
+extern std::atomic<int> g_logLevel;
+
+inline bool logEnabled(int level)
+{
+	return level >= g_logLevel.load(std::memory_order_relaxed);
+}
+
+// Returns the level named "trace", "debug", "info", "warn" or "none", or -1 if the name is unknown.
+int logLevelFromName(const std::string& name);
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_TRACE
+#define LOG_TRACE(...) do { if (logEnabled(LOG_LEVEL_TRACE)) std::cout << __VA_ARGS__; } while (0)
+#else
+#define LOG_TRACE(...) do {} while (0)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) do { if (logEnabled(LOG_LEVEL_DEBUG)) std::cout << __VA_ARGS__; } while (0)
+#else
+#define LOG_DEBUG(...) do {} while (0)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...) do { if (logEnabled(LOG_LEVEL_INFO)) std::cout << __VA_ARGS__; } while (0)
+#else
+#define LOG_INFO(...) do {} while (0)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(...) do { if (logEnabled(LOG_LEVEL_WARN)) std::cerr << __VA_ARGS__; } while (0)
+#else
+#define LOG_WARN(...) do {} while (0)
+#endif
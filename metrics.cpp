@@ -0,0 +1,402 @@
+// metrics.cpp : Prometheus metrics endpoint.
+//
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <afunix.h>
+typedef SOCKET t_socket;
+#define closesocket_ closesocket
+#else
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+typedef int t_socket;
+#define INVALID_SOCKET (-1)
+#define closesocket_ close
+#endif
+
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+#include "eventqueue.h"
+#include "logging.h"
+
+const double c_metricsLatencyBucketsUs[METRICS_LATENCY_BUCKETS] = { 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000 };
+
+s_metrics g_metrics = {};
+bool g_metricsEnabled = false;
+
+// Only the main thread (startup) and the endpoint thread take this lock, never the MIDI threads.
+static std::mutex g_metricsStartupMutex;
+static std::vector<std::pair<std::string, double>> g_metricsStartupPhasesUs;
+static double g_metricsStartupReadyUs = 0.0;
+
+static std::vector<t_socket> g_listenSockets;
+static int g_metricsTcpPort = 0;
+static std::string g_metricsUnixPath;
+static std::thread g_metricsThread;
+static std::atomic<bool> g_metricsRunning(false);
+
+void s_latencyHistogram::observe(unsigned long long ns)
+{
+	int i = 0;
+	while (i < METRICS_LATENCY_BUCKETS and ns > c_metricsLatencyBucketsUs[i] * 1000.0)
+		++i;
+
+	buckets[i].fetch_add(1, std::memory_order_relaxed);
+	sumNs.fetch_add(ns, std::memory_order_relaxed);
+	count.fetch_add(1, std::memory_order_relaxed);
+}
+
+e_metricsMessageType metricsMessageType(unsigned char status)
+{
+	switch (status & 0xF0)
+	{
+	case 0x80: return METRICS_MSG_NOTE_OFF;
+	case 0x90: return METRICS_MSG_NOTE_ON;
+	case 0xB0: return METRICS_MSG_CC;
+	}
+	return METRICS_MSG_OTHER;
+}
+
+void metricsSetStartup(const std::vector<std::pair<std::string, double>>& phasesUs, double readyUs)
+{
+	std::lock_guard<std::mutex> lock(g_metricsStartupMutex);
+	g_metricsStartupPhasesUs = phasesUs;
+	g_metricsStartupReadyUs = readyUs;
+}
+
+static std::string escapeLabel(const std::string& value)
+{
+	std::string escaped;
+	for (char c : value)
+	{
+		if (c == '\\' or c == '"')
+			escaped += '\\';
+		if (c == '\n')
+		{
+			escaped += "\\n";
+			continue;
+		}
+		escaped += c;
+	}
+	return escaped;
+}
+
+static void writeCounter(std::ostringstream& os, const char* name, const char* help, unsigned long long value)
+{
+	os << "# HELP " << name << " " << help << "\n";
+	os << "# TYPE " << name << " counter\n";
+	os << name << " " << value << "\n";
+}
+
+static void writeHistogram(std::ostringstream& os, const char* name, const char* help, const s_latencyHistogram& h)
+{
+	os << "# HELP " << name << " " << help << "\n";
+	os << "# TYPE " << name << " histogram\n";
+
+	unsigned long long cumulative = 0;
+	for (int i = 0; i < METRICS_LATENCY_BUCKETS; ++i)
+	{
+		cumulative += h.buckets[i].load(std::memory_order_relaxed);
+		os << name << "_bucket{le=\"" << c_metricsLatencyBucketsUs[i] / 1000000.0 << "\"} " << cumulative << "\n";
+	}
+	cumulative += h.buckets[METRICS_LATENCY_BUCKETS].load(std::memory_order_relaxed);
+	os << name << "_bucket{le=\"+Inf\"} " << cumulative << "\n";
+	os << name << "_sum " << h.sumNs.load(std::memory_order_relaxed) / 1000000000.0 << "\n";
+	// the count is derived from the buckets so that the exposition stays self-consistent
+	os << name << "_count " << cumulative << "\n";
+}
+
+static std::string renderMetrics()
+{
+	static const char* typeNames[METRICS_MSG_TYPES] = { "note_on", "note_off", "cc", "other" };
+
+	std::ostringstream os;
+	os << "# HELP midi2pico8dx_midi_messages_total MIDI messages received, by type.\n";
+	os << "# TYPE midi2pico8dx_midi_messages_total counter\n";
+	for (int i = 0; i < METRICS_MSG_TYPES; ++i)
+	{
+		os << "midi2pico8dx_midi_messages_total{type=\"" << typeNames[i] << "\"} "
+			<< g_metrics.midiMessages[i].load(std::memory_order_relaxed) << "\n";
+	}
+
+	writeCounter(os, "midi2pico8dx_unmapped_messages_total", "Note and cc messages without a binding in the config.",
+		g_metrics.unmappedMessages.load(std::memory_order_relaxed));
+	writeCounter(os, "midi2pico8dx_key_events_total", "Keyboard events sent with SendInput.",
+		g_metrics.keyEvents.load(std::memory_order_relaxed));
+	// the merge queue counts its overflows itself, they are cheap and only happen when it is full
+	writeCounter(os, "midi2pico8dx_merge_queue_drops_total", "MIDI messages dropped because the merge queue to the main thread was full.",
+		g_eventQueue.drops.load(std::memory_order_relaxed));
+	writeCounter(os, "midi2pico8dx_merge_queue_coalesced_total", "MIDI cc merged into a queued one because the merge queue to the main thread was full.",
+		g_eventQueue.coalesced.load(std::memory_order_relaxed));
+	writeHistogram(os, "midi2pico8dx_dispatch_latency_seconds", "Time from MIDI message arrival to the end of its handling.",
+		g_metrics.dispatchLatency);
+	writeHistogram(os, "midi2pico8dx_midi_interarrival_seconds", "Time between two MIDI messages, as timestamped by the driver.",
+		g_metrics.interArrival);
+
+	std::lock_guard<std::mutex> lock(g_metricsStartupMutex);
+	if (not g_metricsStartupPhasesUs.empty())
+	{
+		os << "# HELP midi2pico8dx_startup_phase_seconds Duration of each startup phase.\n";
+		os << "# TYPE midi2pico8dx_startup_phase_seconds gauge\n";
+		for (auto& phase : g_metricsStartupPhasesUs)
+			os << "midi2pico8dx_startup_phase_seconds{phase=\"" << escapeLabel(phase.first) << "\"} " << phase.second / 1000000.0 << "\n";
+		os << "# HELP midi2pico8dx_startup_ready_seconds Time from process start to the MIDI input being open.\n";
+		os << "# TYPE midi2pico8dx_startup_ready_seconds gauge\n";
+		os << "midi2pico8dx_startup_ready_seconds " << g_metricsStartupReadyUs / 1000000.0 << "\n";
+	}
+
+	return os.str();
+}
+
+// A client that connects and sends nothing must not hold the endpoint thread, nor metricsStop().
+static void setClientTimeouts(t_socket client)
+{
+#ifdef _WIN32
+	DWORD timeout = METRICS_CLIENT_TIMEOUT_MS;
+#else
+	timeval timeout = {};
+	timeout.tv_sec = METRICS_CLIENT_TIMEOUT_MS / 1000;
+	timeout.tv_usec = (METRICS_CLIENT_TIMEOUT_MS % 1000) * 1000;
+#endif
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+	setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+}
+
+static void serveClient(t_socket client)
+{
+	setClientTimeouts(client);
+
+	// The request itself does not matter, every path returns the metrics.
+	// Read until the end of the headers so that the client does not get a reset.
+	char request[1024];
+	std::string received;
+	while (received.find("\r\n\r\n") == std::string::npos and received.size() < 8192)
+	{
+		int n = recv(client, request, sizeof(request), 0);
+		if (n <= 0)
+			break;
+		received.append(request, n);
+	}
+
+	std::string body = renderMetrics();
+	std::ostringstream response;
+	response << "HTTP/1.0 200 OK\r\n"
+		<< "Content-Type: text/plain; version=0.0.4\r\n"
+		<< "Content-Length: " << body.size() << "\r\n"
+		<< "Connection: close\r\n\r\n"
+		<< body;
+
+	std::string data = response.str();
+	size_t sent = 0;
+	while (sent < data.size())
+	{
+		int n = send(client, data.c_str() + sent, (int)(data.size() - sent), 0);
+		if (n <= 0)
+			break;
+		sent += n;
+	}
+
+	closesocket_(client);
+}
+
+static void metricsThread()
+{
+#ifdef _WIN32
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#else
+	// on Linux, nice values are per thread
+	setpriority(PRIO_PROCESS, 0, 19);
+#endif
+
+	std::vector<pollfd> fds;
+	for (t_socket s : g_listenSockets)
+	{
+		pollfd fd = {};
+		fd.fd = s;
+		fd.events = POLLIN;
+		fds.push_back(fd);
+	}
+
+	// no timeout : metricsStop() wakes the thread up by connecting to it
+	while (g_metricsRunning)
+	{
+#ifdef _WIN32
+		int ready = WSAPoll(fds.data(), (ULONG)fds.size(), -1);
+#else
+		int ready = poll(fds.data(), fds.size(), -1);
+#endif
+		if (ready == 0)
+			continue;
+		if (ready < 0)
+		{
+#ifdef _WIN32
+			int error = WSAGetLastError();
+#else
+			int error = errno;
+			if (error == EINTR)
+				continue;
+#endif
+			LOG_WARN("Metrics: poll failed (error " << error << "), the endpoint is stopped\n");
+			break;
+		}
+
+		for (auto& fd : fds)
+		{
+			if (fd.revents & POLLIN)
+			{
+				t_socket client = accept(fd.fd, nullptr, nullptr);
+				if (client == INVALID_SOCKET)
+					continue;
+				if (g_metricsRunning)
+					serveClient(client);
+				else
+					closesocket_(client);
+			}
+		}
+	}
+}
+
+static void wakeMetricsThread()
+{
+	if (g_metricsTcpPort > 0)
+	{
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons((unsigned short)g_metricsTcpPort);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		t_socket s = socket(AF_INET, SOCK_STREAM, 0);
+		if (s != INVALID_SOCKET)
+		{
+			connect(s, (const sockaddr*)&addr, sizeof(addr));
+			closesocket_(s);
+		}
+	}
+	else
+	{
+		sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, g_metricsUnixPath.c_str(), sizeof(addr.sun_path) - 1);
+
+		t_socket s = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (s != INVALID_SOCKET)
+		{
+			connect(s, (const sockaddr*)&addr, sizeof(addr));
+			closesocket_(s);
+		}
+	}
+}
+
+static bool listenOn(t_socket s, const sockaddr* addr, int addrLen, const std::string& description)
+{
+	if (s == INVALID_SOCKET)
+	{
+		LOG_WARN("Metrics: could not create socket for " << description << "\n");
+		return false;
+	}
+
+	if (bind(s, addr, addrLen) != 0 or listen(s, 4) != 0)
+	{
+		LOG_WARN("Metrics: could not listen on " << description << "\n");
+		closesocket_(s);
+		return false;
+	}
+
+	g_listenSockets.push_back(s);
+	LOG_INFO("Metrics available on " << description << "\n");
+	return true;
+}
+
+bool metricsStart(int tcpPort, const std::string& unixPath)
+{
+#ifdef _WIN32
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+	{
+		LOG_WARN("Metrics: WSAStartup failed\n");
+		return false;
+	}
+#endif
+
+	if (tcpPort > 0)
+	{
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons((unsigned short)tcpPort);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		t_socket s = socket(AF_INET, SOCK_STREAM, 0);
+		if (listenOn(s, (const sockaddr*)&addr, sizeof(addr), "http://127.0.0.1:" + std::to_string(tcpPort) + "/metrics"))
+			g_metricsTcpPort = tcpPort;
+	}
+
+	if (not unixPath.empty())
+	{
+		sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, unixPath.c_str(), sizeof(addr.sun_path) - 1);
+		// a stale socket file left by a previous run would make bind fail
+#ifdef _WIN32
+		DeleteFileA(unixPath.c_str());
+#else
+		unlink(unixPath.c_str());
+#endif
+
+		t_socket s = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listenOn(s, (const sockaddr*)&addr, sizeof(addr), "unix:" + unixPath))
+			g_metricsUnixPath = unixPath;
+	}
+
+	if (g_listenSockets.empty())
+	{
+#ifdef _WIN32
+		WSACleanup();
+#endif
+		return false;
+	}
+
+	g_metricsEnabled = true;
+	g_metricsRunning = true;
+	g_metricsThread = std::thread(metricsThread);
+	return true;
+}
+
+void metricsStop()
+{
+	if (not g_metricsRunning)
+		return;
+
+	g_metricsRunning = false;
+	wakeMetricsThread();
+	g_metricsThread.join();
+
+	for (t_socket s : g_listenSockets)
+		closesocket_(s);
+	g_listenSockets.clear();
+
+	if (not g_metricsUnixPath.empty())
+	{
+#ifdef _WIN32
+		DeleteFileA(g_metricsUnixPath.c_str());
+#else
+		unlink(g_metricsUnixPath.c_str());
+#endif
+	}
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
@@ -0,0 +1,65 @@
+// metrics.h : Prometheus metrics endpoint.
+// Opt-in with the "metrics_port" (loopback TCP) or "metrics_socket" (UNIX socket path) config options.
+// Counters are updated with relaxed atomic operations; the endpoint thread only reads them,
+// so scraping never blocks or slows down the MIDI handling.
+//
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <utility>
+#include <vector>
+
+// upper bounds of the latency histogram buckets, in microseconds (+Inf is implicit)
+#define METRICS_LATENCY_BUCKETS 12
+extern const double c_metricsLatencyBucketsUs[METRICS_LATENCY_BUCKETS];
+// a scrape reading or writing slower than this is dropped
+#define METRICS_CLIENT_TIMEOUT_MS 2000
+
+enum e_metricsMessageType
+{
+	METRICS_MSG_NOTE_ON,
+	METRICS_MSG_NOTE_OFF,
+	METRICS_MSG_CC,
+	METRICS_MSG_OTHER,
+	METRICS_MSG_TYPES
+};
+
+struct s_latencyHistogram
+{
+	std::atomic<unsigned long long> buckets[METRICS_LATENCY_BUCKETS + 1];
+	std::atomic<unsigned long long> count;
+	std::atomic<unsigned long long> sumNs;
+
+	void observe(unsigned long long ns);
+};
+
+struct s_metrics
+{
+	std::atomic<unsigned long long> midiMessages[METRICS_MSG_TYPES];
+	std::atomic<unsigned long long> unmappedMessages;
+	std::atomic<unsigned long long> keyEvents;
+
+	// time from message arrival in the MIDI callback to the last SendInput, queue hop included
+	s_latencyHistogram dispatchLatency;
+	// time between two messages, as timestamped by the driver
+	s_latencyHistogram interArrival;
+};
+
+extern s_metrics g_metrics;
+extern bool g_metricsEnabled;
+
+inline void metricsCount(std::atomic<unsigned long long>& counter)
+{
+	counter.fetch_add(1, std::memory_order_relaxed);
+}
+
+e_metricsMessageType metricsMessageType(unsigned char status);
+
+// Starts the endpoint thread. tcpPort <= 0 and an empty unixPath disable the corresponding listener.
+bool metricsStart(int tcpPort, const std::string& unixPath);
+void metricsStop();
+
+// Startup phase durations (name, us) and time to dispatch-ready, exported as gauges.
+void metricsSetStartup(const std::vector<std::pair<std::string, double>>& phasesUs, double readyUs);
@@ -4,11 +4,20 @@
 #include <iostream>
 #include <fstream>
 #include <cstdlib>
+#include <algorithm>
 #include <map>
+#include <regex>
+#include <set>
+#include <unordered_map>
+#include <vector>
 #include <Windows.h>
 
 #include "RtMidi.h"
 #include "json.hpp"
+#include "logging.h"
+#include "timing.h"
+#include "metrics.h"
+#include "eventqueue.h"
 
 using json = nlohmann::json;
 
@@ -21,7 +30,7 @@ using json = nlohmann::json;
 
 int g_lastNumpadValue = 0;
 bool g_altInput=false;
-std::string g_portName;
+bool g_analyzeTiming = false;
 
 typedef struct s_key
 {
@@ -42,6 +51,13 @@ typedef struct s_knob
 };
 
 #define JSTR_LOG_MIDI_MESSAGES	"log_midi_messages"
+#define JSTR_LOG_LEVEL			"log_level"
+#define JSTR_ANALYZE_TIMING		"analyze_timing"
+#define JSTR_METRICS_PORT		"metrics_port"
+#define JSTR_METRICS_SOCKET		"metrics_socket"
+#define JSTR_VIRTUAL_PORT		"virtual_port"
+#define JSTR_INPUT_QUEUE_SIZE	"input_queue_size"
+#define JSTR_INPUT_QUEUE_OVERFLOW	"input_queue_overflow"
 #define JSTR_SWITCH_ALT_INPUTS	"switch_to_alt_inputs"
 
 #define JSTR_TYPE				"type"
@@ -51,6 +67,9 @@ typedef struct s_knob
 
 #define JSTR_DEVICES			"devices"
 #define JSTR_PORTNAME			"name"
+#define JSTR_PORTNAME_PREFIX	"name_prefix"
+#define JSTR_PORTNAME_REGEX		"name_regex"
+#define JSTR_PRIORITY			"priority"
 #define JSTR_CONTROL_INPUTS		"control_inputs"
 #define JSTR_NOTE				"note"
 #define JSTR_CC					"cc"
@@ -60,6 +79,17 @@ typedef struct s_knob
 #define JSTR_INPUTP				"input+"
 #define JSTR_THRESHOLD			"threshold"
 
+#define JSTR_FEEDBACK			"feedback"
+#define JSTR_OUTPUT				"output"
+#define JSTR_LEDS				"leds"
+#define JSTR_STATE				"state"
+#define JSTR_STATE_ALT			"alt_inputs"
+#define JSTR_STATE_NUMPAD		"numpad"
+#define JSTR_STATE_KEY			"key"
+#define JSTR_CHANNEL			"channel"
+#define JSTR_ON					"on"
+#define JSTR_OFF				"off"
+
 #define JSTR_SINPUT_NUMPADSET	"numpadset"
 #define JSTR_SINPUT_NUMPADSEND	"numpadsend"
 
@@ -170,8 +200,6 @@ json c_defaultConf =
 	}},
 };
 
-std::map<int, bool> g_btns = {};
-
 // hardcoded key definitions that can be used in this software.
 std::map<short, s_key> g_keys = {
 	{VK_DOWN,{0x50,true,"Down"}},
@@ -235,7 +263,83 @@ std::map<short, s_key> g_keys = {
 };
 
 json* g_currentConf = 0;
-json* g_currentDev = 0;
+
+// kinds of "devices" entries, in matching order for equal priorities
+enum e_matchKind
+{
+	MATCH_NAME,		// "name" equal to the port name, or to it without its port number
+	MATCH_PREFIX,	// "name_prefix"
+	MATCH_REGEX,	// "name_regex"
+	MATCH_ANY,		// no name, or a blank one
+};
+
+struct s_deviceRule
+{
+	e_matchKind kind;
+	int priority;
+	size_t order;		// position in the "devices" array
+	std::string text;	// name or prefix
+	std::regex regex;
+	json* device;
+};
+
+// built from the "devices" config at load by indexDevices()
+// "name" entries by name. The config names are kept as written: a model number
+// ("MPK mini 3") cannot be told apart from a port number, only port names are stripped.
+std::unordered_map<std::string, s_deviceRule> g_deviceNames;
+// other entries, best first
+std::vector<s_deviceRule> g_deviceRules;
+
+enum e_feedbackState
+{
+	FEEDBACK_ALT,		// alt inputs switched on
+	FEEDBACK_NUMPAD,	// virtual numpad value, sent as is
+	FEEDBACK_KEY,		// key held down by any input
+};
+
+// one "leds" entry of a device "feedback" config
+struct s_feedbackLed
+{
+	e_feedbackState state;
+	short vk;				// FEEDBACK_KEY only
+	unsigned char status;	// cc or note on, with the channel
+	unsigned char data1;	// cc or note number
+	unsigned char on;
+	unsigned char off;
+	int lastSent;			// -1 until sent once since the output was opened
+};
+
+// one per MIDI input port seen since startup, kept while the port is unplugged
+// so that it gets its profile back as soon as it reappears
+struct s_input
+{
+	std::string portName;
+	// port published by this program for other software to send to, never unplugged
+	bool isVirtual;
+	// 0 while the port is unplugged
+	RtMidiIn* midiin;
+	// entry of the "devices" config matching this port, 0 if none
+	json* device;
+	// last state of the "btn" control inputs, by cc
+	std::map<int, bool> btns;
+	// keys pressed by this input and not released yet
+	std::set<short> heldKeys;
+	// compiled "feedback" config of the device, and its output while connected
+	std::vector<s_feedbackLed> feedback;
+	std::string feedbackPortName;
+	RtMidiOut* feedbackOut;
+	// cc mapped to an absolute value (numpad set knobs), which a full event queue may merge
+	// instead of dropping. Never changes once created, read by the RtMidi threads.
+	bool coalescibleCc[128];
+	bool hasLastTimeStamp;
+	unsigned long long lastTimeStamp;
+};
+
+std::vector<s_input*> g_inputs;
+// signaled by the input threads when they queue messages
+HANDLE g_eventSignal = NULL;
+// API of the controller inputs: where available, one client and thread receive all of them
+RtMidi::Api g_inputApi = RtMidi::UNSPECIFIED;
 
 bool keypress(short vk, bool press, bool release)
 {
@@ -260,20 +364,22 @@ bool keypress(short vk, bool press, bool release)
 			if (press)
 			{
 				SendInput(1, &ip, sizeof(INPUT));
+				metricsCount(g_metrics.keyEvents);
 			}
 
 			if (release)
 			{
 				ip.ki.dwFlags |= KEYEVENTF_KEYUP;
 				SendInput(1, &ip, sizeof(INPUT));
+				metricsCount(g_metrics.keyEvents);
 			}
 
 			if (press and release)
-				std::cout << "hit " << key.name << "\n";
+				LOG_INFO("hit " << key.name << "\n");
 			else if (press)
-				std::cout << "press " << key.name << "\n";
+				LOG_INFO("press " << key.name << "\n");
 			else if (release)
-				std::cout << "release " << key.name << "\n";
+				LOG_INFO("release " << key.name << "\n");
 
 			return true;
 		}
@@ -282,17 +388,72 @@ bool keypress(short vk, bool press, bool release)
 	return false;
 }
 
-void mycallback(double deltatime, std::vector< unsigned char > *message, void *userData)
+// Same as keypress, remembering which keys the input holds down.
+bool inputKeypress(s_input& input, short vk, bool press, bool release)
 {
-	unsigned int nBytes = message->size();
-	int type = message->at(0);
+	bool sent = keypress(vk, press, release);
+	if (sent and press and not release)
+		input.heldKeys.insert(vk);
+	else if (sent and release and not press)
+		input.heldKeys.erase(vk);
+	return sent;
+}
+
+// Called by RtMidi from the thread of each input port. Only queues the message for the main thread.
+void mycallback(unsigned long long timeStamp, const unsigned char* message, size_t size, void *userData)
+{
+	s_midiEvent event;
+	if (g_analyzeTiming or g_metricsEnabled)
+		event.arrival = std::chrono::steady_clock::now();
+
+	if (size == 0 or size > EVENT_MAX_BYTES)
+		return;
+
+	event.input = (s_input*)userData;
+	event.timeStamp = timeStamp;
+	event.size = (unsigned char)size;
+	for (size_t i = 0; i < size; ++i)
+		event.bytes[i] = message[i];
+	event.coalescible = size == 3 and (message[0] & 0xF0) == 0xB0 and message[1] < 128 and event.input->coalescibleCc[message[1]];
+
+	// signaled whatever the result: a full queue may have had its oldest cell held away from the main thread
+	e_pushResult result = g_eventQueue.push(event);
+	if (result == PUSH_DROPPED)
+		LOG_DEBUG("MIDI event queue full, message from \"" << event.input->portName << "\" dropped\n");
+	SetEvent(g_eventSignal);
+}
+
+// Maps one MIDI message to key events. Main thread only.
+void handleMessage(const s_midiEvent& event)
+{
+	s_input& input = *event.input;
+	const unsigned char* message = event.bytes;
+	unsigned long long timeStamp = event.timeStamp;
+	t_timePoint arrival = event.arrival;
+
+	// delta with the previous message of the same port, as timestamped by the driver
+	double deltatime = input.hasLastTimeStamp ? (timeStamp - input.lastTimeStamp) * 0.000000001 : 0.0;
+	input.hasLastTimeStamp = true;
+	input.lastTimeStamp = timeStamp;
+
+	unsigned int nBytes = event.size;
+	int type = message[0];
+
+	if (g_metricsEnabled)
+	{
+		metricsCount(g_metrics.midiMessages[metricsMessageType(type)]);
+		// RtMidi reports a zero delta for the first message
+		if (deltatime > 0.0)
+			g_metrics.interArrival.observe((unsigned long long)(deltatime * 1000000000.0));
+	}
+	LOG_TRACE("midi in: " << nBytes << " bytes, status " << type << ", delta " << deltatime << "s\n");
 
 	// 0x80-8F: note off messages
 	// 0x90-9F: note on messages
-	if (type>=0x80 and type<=0x9F)
+	if (type>=0x80 and type<=0x9F and nBytes >= 3)
 	{
-		int note = message->at(1);
-		bool press = message->at(2) != 0 and type >= 0x90;
+		int note = message[1];
+		bool press = message[2] != 0 and type >= 0x90;
 		bool found = false;
 
 		if (g_currentConf->contains(JSTR_NOTE_INPUTS))
@@ -305,28 +466,29 @@ void mycallback(double deltatime, std::vector< unsigned char > *message, void *u
 				{
 					auto key = inputData.at(JSTR_INPUT);
 					short vk = g_jstrToVk.at(key);
-					found = keypress(vk, press, !press);
+					found = inputKeypress(input, vk, press, !press);
 					break;
 				}
 			}
 		}
 		if (!found)
 		{
-			std::cout << "note " << note << "\n";
+			metricsCount(g_metrics.unmappedMessages);
+			LOG_INFO("note " << note << "\n");
 		}
 	}
 	// 0x90-9F: control messages
-	else if (type >= 0xB0 and type <= 0xBF)
+	else if (type >= 0xB0 and type <= 0xBF and nBytes >= 3)
 	{
-		int cc = message->at(1);
-		int val = message->at(2);
+		int cc = message[1];
+		int val = message[2];
 		bool found = false;
 
-		if (g_currentDev != 0)
+		if (input.device != 0)
 		{
-			if (g_currentDev->contains(JSTR_CONTROL_INPUTS))
+			if (input.device->contains(JSTR_CONTROL_INPUTS))
 			{
-				json inputArray = g_currentDev->at(JSTR_CONTROL_INPUTS);
+				json inputArray = input.device->at(JSTR_CONTROL_INPUTS);
 				for (int i = inputArray.size() - 1; i >= 0; --i)
 				{
 					json inputData = inputArray[i];
@@ -341,17 +503,17 @@ void mycallback(double deltatime, std::vector< unsigned char > *message, void *u
 							bool release = false;
 							found = true;
 
-							if (g_btns.find(cc) == g_btns.end())
+							if (input.btns.find(cc) == input.btns.end())
 							{
 								press = val >= midValue;
-								g_btns[cc] = press;
+								input.btns[cc] = press;
 							}
 							else
 							{
 								bool on = val >= midValue;
-								if (on != g_btns[cc])
+								if (on != input.btns[cc])
 								{
-									g_btns[cc] = on;
+									input.btns[cc] = on;
 									press = on;
 									release = not on;
 								}
@@ -364,11 +526,11 @@ void mycallback(double deltatime, std::vector< unsigned char > *message, void *u
 									g_altInput = val != 0;
 									if (g_altInput)
 									{
-										std::cout << "alt inputs ON\n";
+										LOG_INFO("alt inputs ON\n");
 									}
 									else
 									{
-										std::cout << "alt inputs OFF\n";
+										LOG_INFO("alt inputs OFF\n");
 									}
 								}
 								else
@@ -379,7 +541,7 @@ void mycallback(double deltatime, std::vector< unsigned char > *message, void *u
 									}
 
 									short vk = g_jstrToVk.at(key);
-									keypress(vk, press, !press);
+									inputKeypress(input, vk, press, !press);
 								}
 							}
 						}
@@ -392,7 +554,7 @@ void mycallback(double deltatime, std::vector< unsigned char > *message, void *u
 								if (val != g_lastNumpadValue)
 								{
 									g_lastNumpadValue = val;
-									std::cout << "virtual numpad set to " << g_lastNumpadValue << "\n";
+									LOG_INFO("virtual numpad set to " << g_lastNumpadValue << "\n");
 								}
 
 								found = true;
@@ -425,7 +587,8 @@ void mycallback(double deltatime, std::vector< unsigned char > *message, void *u
 
 		if (!found)
 		{
-			std::cout << "cc " << cc << " val " << val << "\n";
+			metricsCount(g_metrics.unmappedMessages);
+			LOG_INFO("cc " << cc << " val " << val << "\n");
 		}
 	}
 
@@ -433,40 +596,610 @@ void mycallback(double deltatime, std::vector< unsigned char > *message, void *u
 	{
 		if (nBytes == 3)
 		{
-			std::cout << "Status = " << (int)message->at(0) << ", ";
-			std::cout << "Data1 = " << (int)message->at(1) << ", ";
-			std::cout << "Data2 = " << (int)message->at(2) << "\n";
+			LOG_INFO("Status = " << (int)message[0] << ", ");
+			LOG_INFO("Data1 = " << (int)message[1] << ", ");
+			LOG_INFO("Data2 = " << (int)message[2] << "\n");
 		}
 		else if (nBytes > 0)
 		{
 			for (unsigned int i = 0; i < nBytes; i++)
 			{
-				std::cout << "Byte " << i << " = " << (int)message->at(i);
+				LOG_INFO("Byte " << i << " = " << (int)message[i]);
 				if (i < nBytes-1)
 				{
-					std::cout << ", ";
+					LOG_INFO(", ");
 				}
 			}
 
-			std::cout << "\n";
+			LOG_INFO("\n");
+		}
+	}
+
+	if (g_analyzeTiming or g_metricsEnabled)
+	{
+		t_timePoint handled = std::chrono::steady_clock::now();
+		if (g_analyzeTiming)
+			timingRecord(input.portName, message[0], deltatime, timeStamp, arrival, handled);
+		if (g_metricsEnabled)
+			g_metrics.dispatchLatency.observe(std::chrono::duration_cast<std::chrono::nanoseconds>(handled - arrival).count());
+	}
+}
+
+void handleQueuedMessages()
+{
+	s_midiEvent event;
+	while (g_eventQueue.pop(event))
+		handleMessage(event);
+}
+
+// Higher priority first, then by kind, longer prefix, and position in the config.
+bool ruleBefore(const s_deviceRule& a, const s_deviceRule& b)
+{
+	if (a.priority != b.priority)
+		return a.priority > b.priority;
+	if (a.kind != b.kind)
+		return a.kind < b.kind;
+	if (a.kind == MATCH_PREFIX and a.text.size() != b.text.size())
+		return a.text.size() > b.text.size();
+	return a.order < b.order;
+}
+
+// Port name without the address the MIDI API appends to tell ports apart: the port number
+// on Windows ("MPK mini 3 0"), the client:port or hw:card,device,subdevice numbers on ALSA.
+// The same controller gets a different one depending on where and when it is plugged.
+std::string portIdentity(const std::string& portName)
+{
+	size_t space = portName.find_last_of(' ');
+	if (space == std::string::npos or space == 0)
+		return portName;
+
+	std::string suffix = portName.substr(space + 1);
+	bool address = not suffix.empty() and suffix.find_first_not_of("0123456789:,") == std::string::npos;
+	if (address or suffix.compare(0, 3, "hw:") == 0)
+		return portName.substr(0, space);
+	return portName;
+}
+
+void addNameRule(std::unordered_map<std::string, s_deviceRule>& names, const std::string& name, const s_deviceRule& rule)
+{
+	auto it = names.find(name);
+	if (it == names.end() or ruleBefore(rule, it->second))
+		names[name] = rule;
+}
+
+// Precompiles the "devices" entries of the current config for findDevice.
+void indexDevices()
+{
+	g_deviceNames.clear();
+	g_deviceRules.clear();
+	if (not g_currentConf->contains(JSTR_DEVICES))
+		return;
+
+	json& deviceArray = g_currentConf->at(JSTR_DEVICES);
+	for (size_t i = 0; i < deviceArray.size(); ++i)
+	{
+		json& deviceData = deviceArray[i];
+		s_deviceRule rule;
+		rule.priority = deviceData.value(JSTR_PRIORITY, 0);
+		rule.order = i;
+		rule.device = &deviceData;
+
+		if (deviceData.contains(JSTR_PORTNAME_PREFIX))
+		{
+			rule.kind = MATCH_PREFIX;
+			rule.text = deviceData.at(JSTR_PORTNAME_PREFIX);
+			g_deviceRules.push_back(rule);
+		}
+		else if (deviceData.contains(JSTR_PORTNAME_REGEX))
+		{
+			rule.kind = MATCH_REGEX;
+			rule.text = deviceData.at(JSTR_PORTNAME_REGEX);
+			try
+			{
+				rule.regex = std::regex(rule.text, std::regex::ECMAScript | std::regex::optimize);
+			}
+			catch (std::regex_error& ex)
+			{
+				LOG_WARN("Invalid " << JSTR_PORTNAME_REGEX << " \"" << rule.text << "\" for config device " << i << ": " << ex.what() << "\n");
+				continue;
+			}
+			g_deviceRules.push_back(rule);
+		}
+		else if (deviceData.contains(JSTR_PORTNAME) and deviceData.at(JSTR_PORTNAME) != "")
+		{
+			rule.kind = MATCH_NAME;
+			rule.text = deviceData.at(JSTR_PORTNAME);
+			addNameRule(g_deviceNames, rule.text, rule);
+		}
+		else
+		{
+			rule.kind = MATCH_ANY;
+			g_deviceRules.push_back(rule);
+		}
+	}
+
+	std::stable_sort(g_deviceRules.begin(), g_deviceRules.end(), ruleBefore);
+	LOG_DEBUG("Indexed " << g_deviceNames.size() << " device names and " << g_deviceRules.size() << " other device rules\n");
+}
+
+bool ruleMatches(const s_deviceRule& rule, const std::string& portName)
+{
+	switch (rule.kind)
+	{
+	case MATCH_PREFIX: return portName.compare(0, rule.text.size(), rule.text) == 0;
+	case MATCH_REGEX: return std::regex_search(portName, rule.regex);
+	case MATCH_ANY: return true;
+	default: return false;
+	}
+}
+
+// Returns the best entry of the "devices" config for portName, 0 if none.
+// An exact name is a hash lookup, the other rules are only tried if they may have a higher priority.
+json* findDevice(const std::string& portName)
+{
+	const s_deviceRule* best = 0;
+	auto it = g_deviceNames.find(portName);
+	if (it != g_deviceNames.end())
+	{
+		best = &it->second;
+	}
+	else
+	{
+		// a config name written without the address matches the controller at any address
+		it = g_deviceNames.find(portIdentity(portName));
+		if (it != g_deviceNames.end())
+			best = &it->second;
+	}
+
+	for (const s_deviceRule& rule : g_deviceRules)
+	{
+		if (best != 0 and not ruleBefore(rule, *best))
+			break;
+		if (ruleMatches(rule, portName))
+		{
+			best = &rule;
+			break;
+		}
+	}
+
+	if (best == 0)
+		return 0;
+
+	LOG_DEBUG("Config device " << best->order << " matches \"" << portName << "\"\n");
+	return best->device;
+}
+
+// Reads the "feedback" config of the input device, if any.
+// Marks the cc whose last control input (the one handleMessage uses) is a numpad set knob:
+// only their latest value matters. Buttons and relative knobs send a key per message.
+void compileCoalescing(s_input* input)
+{
+	std::fill(input->coalescibleCc, input->coalescibleCc + 128, false);
+	if (input->device == 0 or not input->device->contains(JSTR_CONTROL_INPUTS))
+		return;
+
+	json& inputArray = input->device->at(JSTR_CONTROL_INPUTS);
+	for (size_t i = 0; i < inputArray.size(); ++i)
+	{
+		json& inputData = inputArray[i];
+		int cc = inputData.value(JSTR_CC, -1);
+		if (cc < 0 or cc >= 128)
+			continue;
+		input->coalescibleCc[cc] = inputData.value(JSTR_TYPE, std::string()) == JSTR_TYPE_KNOB
+			and inputData.value(JSTR_INPUTM, std::string()) == JSTR_SINPUT_NUMPADSET;
+	}
+}
+
+void compileFeedback(s_input* input)
+{
+	input->feedback.clear();
+	if (input->device == 0 or not input->device->contains(JSTR_FEEDBACK))
+		return;
+
+	json& feedbackData = input->device->at(JSTR_FEEDBACK);
+	input->feedbackPortName = feedbackData.value(JSTR_OUTPUT, std::string());
+	if (not feedbackData.contains(JSTR_LEDS))
+		return;
+
+	json& ledArray = feedbackData.at(JSTR_LEDS);
+	for (size_t i = 0; i < ledArray.size(); ++i)
+	{
+		json& ledData = ledArray[i];
+		s_feedbackLed led;
+		led.vk = 0;
+		led.on = (unsigned char)(ledData.value(JSTR_ON, 127) & 0x7F);
+		led.off = (unsigned char)(ledData.value(JSTR_OFF, 0) & 0x7F);
+		led.lastSent = -1;
+
+		unsigned char channel = (unsigned char)((ledData.value(JSTR_CHANNEL, 1) - 1) & 0x0F);
+		if (ledData.contains(JSTR_CC))
+		{
+			led.status = 0xB0 | channel;
+			led.data1 = (unsigned char)(ledData.value(JSTR_CC, 0) & 0x7F);
+		}
+		else if (ledData.contains(JSTR_NOTE))
+		{
+			led.status = 0x90 | channel;
+			led.data1 = (unsigned char)(ledData.value(JSTR_NOTE, 0) & 0x7F);
+		}
+		else
+		{
+			LOG_WARN("Feedback led " << i << " of \"" << input->portName << "\" has no cc or note, ignored.\n");
+			continue;
+		}
+
+		std::string state = ledData.value(JSTR_STATE, std::string());
+		if (state == JSTR_STATE_ALT)
+		{
+			led.state = FEEDBACK_ALT;
+		}
+		else if (state == JSTR_STATE_NUMPAD)
+		{
+			led.state = FEEDBACK_NUMPAD;
+		}
+		else if (state == JSTR_STATE_KEY and g_jstrToVk.count(ledData.value(JSTR_INPUT, std::string())) > 0)
+		{
+			led.state = FEEDBACK_KEY;
+			led.vk = g_jstrToVk.at(ledData.value(JSTR_INPUT, std::string()));
+		}
+		else
+		{
+			LOG_WARN("Feedback led " << i << " of \"" << input->portName << "\" has an unknown state or input, ignored.\n");
+			continue;
+		}
+
+		input->feedback.push_back(led);
+	}
+}
+
+// Opens the output the feedback of the input is sent to: the "output" port of its config,
+// or else the output port of the same controller.
+void openFeedback(s_input* input)
+{
+	if (input->feedback.empty())
+		return;
+
+	std::string wanted = input->feedbackPortName.empty() ? input->portName : input->feedbackPortName;
+	RtMidiOut* midiout = new RtMidiOut();
+	unsigned int portCount = midiout->getPortCount();
+	unsigned int port = portCount;
+	for (unsigned int i = 0; i < portCount and port == portCount; ++i)
+	{
+		if (midiout->getPortName(i) == wanted)
+			port = i;
+	}
+	// same controller at another address: a config "output" is written without it, as device names
+	std::string identity = input->feedbackPortName.empty() ? portIdentity(input->portName) : input->feedbackPortName;
+	for (unsigned int i = 0; i < portCount and port == portCount; ++i)
+	{
+		if (portIdentity(midiout->getPortName(i)) == identity)
+			port = i;
+	}
+
+	if (port == portCount)
+	{
+		LOG_WARN("No MIDI output \"" << wanted << "\" for the feedback of \"" << input->portName << "\".\n");
+		delete midiout;
+		return;
+	}
+
+	try
+	{
+		midiout->openPort(port);
+	}
+	catch (RtMidiError& error)
+	{
+		LOG_WARN("Could not open feedback output \"" << wanted << "\": " << error.getMessage() << "\n");
+		delete midiout;
+		return;
+	}
+
+	input->feedbackOut = midiout;
+	for (s_feedbackLed& led : input->feedback)
+		led.lastSent = -1;
+	LOG_INFO("Sending feedback to \"" << midiout->getPortName(port) << "\"\n");
+}
+
+void closeFeedback(s_input* input)
+{
+	delete input->feedbackOut;
+	input->feedbackOut = 0;
+}
+
+bool keyHeld(short vk)
+{
+	for (s_input* input : g_inputs)
+	{
+		if (input->heldKeys.count(vk) > 0)
+			return true;
+	}
+	return false;
+}
+
+// Sends the feedback values that changed since they were last sent. Called once per batch
+// of handled messages, so a burst of messages sends at most one update per led, in one batch.
+void updateFeedback()
+{
+	std::vector<unsigned char> bytes;
+	std::vector<RtMidiOut::Message> messages;
+	for (s_input* input : g_inputs)
+	{
+		if (input->feedbackOut == 0)
+			continue;
+
+		bytes.resize(input->feedback.size() * 3);
+		messages.clear();
+		for (s_feedbackLed& led : input->feedback)
+		{
+			int value;
+			switch (led.state)
+			{
+			case FEEDBACK_ALT: value = g_altInput ? led.on : led.off; break;
+			case FEEDBACK_NUMPAD: value = g_lastNumpadValue; break;
+			default: value = keyHeld(led.vk) ? led.on : led.off; break;
+			}
+
+			if (value == led.lastSent)
+				continue;
+
+			unsigned char* message = &bytes[messages.size() * 3];
+			message[0] = led.status;
+			message[1] = led.data1;
+			message[2] = (unsigned char)value;
+			messages.push_back({ message, 3 });
+			led.lastSent = value;
+		}
+
+		if (messages.empty())
+			continue;
+
+		try
+		{
+			input->feedbackOut->sendMessages(&messages[0], messages.size());
+		}
+		catch (RtMidiError& error)
+		{
+			LOG_WARN("Feedback to \"" << input->portName << "\" stopped: " << error.getMessage() << "\n");
+			closeFeedback(input);
+		}
+	}
+}
+
+s_input* createInput(const std::string& portName)
+{
+	s_input* input = new s_input();
+	input->portName = portName;
+	input->isVirtual = false;
+	input->midiin = 0;
+	input->feedbackOut = 0;
+	input->hasLastTimeStamp = false;
+	input->lastTimeStamp = 0;
+
+	input->device = findDevice(portName);
+	if (input->device != 0)
+		LOG_INFO("Found device " << input->device->value(JSTR_PORTNAME, std::string()) << " in config for \"" << portName << "\"!\n");
+	else
+		LOG_INFO("No corresponding device found in config for \"" << portName << "\". Control inputs will not be available.\n");
+
+	compileFeedback(input);
+	compileCoalescing(input);
+	return input;
+}
+
+// portNumber is ignored for virtual inputs.
+bool connectInput(s_input* input, unsigned int portNumber)
+{
+	input->hasLastTimeStamp = false;
+	input->midiin = new RtMidiIn(input->isVirtual ? RtMidi::UNSPECIFIED : g_inputApi);
+	input->midiin->setRawCallback(&mycallback, input);
+	input->midiin->ignoreTypes(true, true, true);
+	// notes and cc are mapped, or logged to help writing the config, the other messages are only logged on request
+	if (not g_currentConf->value(JSTR_LOG_MIDI_MESSAGES, false))
+		input->midiin->acceptChannelMessages(RtMidiIn::NOTE_OFF | RtMidiIn::NOTE_ON | RtMidiIn::CONTROL_CHANGE);
+
+	RtMidi::Api api = input->midiin->getCurrentApi();
+	if (input->isVirtual and (api == RtMidi::WINDOWS_MM or api == RtMidi::LINUX_ALSA_RAW or api == RtMidi::RTMIDI_DUMMY))
+	{
+		LOG_WARN("The " << RtMidi::getApiDisplayName(api) << " MIDI API cannot publish the virtual port \"" << input->portName
+			<< "\", use a loopback driver (such as loopMIDI) and plug its port instead.\n");
+		delete input->midiin;
+		input->midiin = 0;
+		return false;
+	}
+
+	try
+	{
+		if (input->isVirtual)
+			input->midiin->openVirtualPort(input->portName);
+		else
+			input->midiin->openPort(portNumber);
+	}
+	catch (RtMidiError& error)
+	{
+		// the port may have disappeared since it was listed, the next port change will retry
+		LOG_WARN("Could not open \"" << input->portName << "\": " << error.getMessage() << "\n");
+		delete input->midiin;
+		input->midiin = 0;
+		return false;
+	}
+
+	LOG_INFO("Reading MIDI input from device \"" << input->portName << "\"...\n");
+	openFeedback(input);
+	return true;
+}
+
+// Closes the port and releases the keys it holds. The input keeps its profile.
+void disconnectInput(s_input* input)
+{
+	input->midiin->closePort();
+	// messages queued before the port was closed still belong to this input
+	handleQueuedMessages();
+
+	for (short vk : input->heldKeys)
+		keypress(vk, false, true);
+	input->heldKeys.clear();
+	input->btns.clear();
+	closeFeedback(input);
+
+	delete input->midiin;
+	input->midiin = 0;
+}
+
+// Binds the port to a live input under its new name. WinMM numbers the ports in every name,
+// so unplugging one controller renames the ones after it.
+void renameInput(s_input* input, const std::string& portName)
+{
+	LOG_INFO("MIDI device \"" << input->portName << "\" is now \"" << portName << "\".\n");
+	input->portName = portName;
+}
+
+// Matches the opened inputs against the current port list: inputs whose port is gone are
+// disconnected, ports seen before get their input back, new ports get a new input.
+void updateInputs(RtMidiIn* midiin)
+{
+	unsigned int portCount = midiin->getPortCount();
+	std::vector<std::string> names(portCount);
+	std::vector<std::string> identities(portCount);
+	std::vector<bool> taken(portCount, false);
+	for (unsigned int i = 0; i < portCount; ++i)
+	{
+		names[i] = midiin->getPortName(i);
+		identities[i] = portIdentity(names[i]);
+	}
+
+	// live inputs keep their port: same name first, then same device under another number
+	std::vector<s_input*> unmatched;
+	for (s_input* input : g_inputs)
+	{
+		if (input->midiin == 0 or input->isVirtual)
+			continue;
+
+		bool found = false;
+		for (unsigned int i = 0; i < portCount and not found; ++i)
+		{
+			if (not taken[i] and names[i] == input->portName)
+				taken[i] = found = true;
+		}
+		if (not found)
+			unmatched.push_back(input);
+	}
+
+	for (s_input* input : unmatched)
+	{
+		std::string identity = portIdentity(input->portName);
+		bool found = false;
+		for (unsigned int i = 0; i < portCount and not found; ++i)
+		{
+			if (not taken[i] and identities[i] == identity)
+			{
+				taken[i] = found = true;
+				renameInput(input, names[i]);
+			}
+		}
+
+		if (not found)
+		{
+			LOG_INFO("MIDI device \"" << input->portName << "\" disconnected, waiting for it to come back.\n");
+			disconnectInput(input);
 		}
 	}
+
+	for (unsigned int i = 0; i < portCount; ++i)
+	{
+		if (taken[i])
+			continue;
+
+		// a replugged device usually gets another number, reattach its input and compiled profile
+		s_input* input = 0;
+		for (s_input* candidate : g_inputs)
+		{
+			if (candidate->midiin != 0 or candidate->isVirtual)
+				continue;
+			if (candidate->portName == names[i])
+			{
+				input = candidate;
+				break;
+			}
+			if (input == 0 and portIdentity(candidate->portName) == identities[i])
+				input = candidate;
+		}
+
+		if (input != 0)
+		{
+			LOG_INFO("MIDI device \"" << input->portName << "\" reconnected as \"" << names[i] << "\".\n");
+			input->portName = names[i];
+		}
+		else
+		{
+			input = createInput(names[i]);
+			g_inputs.push_back(input);
+		}
+
+		connectInput(input, i);
+	}
+
+	updateFeedback();
+}
+
+// Called by RtMidi from its notification thread when MIDI input ports appear or disappear.
+void onPortListChange(unsigned long long generation, void* userData)
+{
+	LOG_DEBUG("MIDI input ports changed (generation " << generation << ")\n");
+	SetEvent((HANDLE)userData);
+}
+
+// Blocks until MIDI messages are queued, the port list changes or a key is typed in the console,
+// and handles the queued messages. Returns true if ESC was pressed.
+// The console only receives keys while it has the focus.
+bool waitForEvents(HANDLE portEvent, HANDLE console)
+{
+	HANDLE handles[3] = { g_eventSignal, portEvent, console };
+	DWORD count = console != NULL ? 3 : 2;
+	DWORD result = WaitForMultipleObjects(count, handles, FALSE, INFINITE);
+	if (result == WAIT_OBJECT_0)
+	{
+		handleQueuedMessages();
+		updateFeedback();
+	}
+	if (result != WAIT_OBJECT_0 + 2)
+		return false;
+
+	DWORD pending = 0;
+	GetNumberOfConsoleInputEvents(console, &pending);
+	while (pending > 0)
+	{
+		INPUT_RECORD records[16];
+		DWORD read = 0;
+		if (not ReadConsoleInput(console, records, 16, &read) or read == 0)
+			break;
+
+		for (DWORD i = 0; i < read; ++i)
+		{
+			if (records[i].EventType == KEY_EVENT and records[i].Event.KeyEvent.bKeyDown and records[i].Event.KeyEvent.wVirtualKeyCode == VK_ESCAPE)
+				return true;
+		}
+		pending = pending > read ? pending - read : 0;
+	}
+
+	return false;
 }
 
 int main()
 {
-	std::cout << "============================\n";
-	std::cout << "* MIDI to PICO-8    v0.2.1 *\n";
-	std::cout << "============================\n\n";
+	g_startupTiming.begin();
+
+	LOG_INFO("============================\n");
+	LOG_INFO("* MIDI to PICO-8    v0.2.1 *\n");
+	LOG_INFO("============================\n\n");
 
 	// load config file
 	json data;
-	json device;
-	std::cout << "Loading '" << CONFIG_FILE_NAME << "'...\n";
+	LOG_INFO("Loading '" << CONFIG_FILE_NAME << "'...\n");
 	std::ifstream confFile(CONFIG_FILE_NAME);
+	g_startupTiming.endPhase("config open");
 	if (confFile.fail())
 	{
-		std::cout << "Could not load '" << CONFIG_FILE_NAME << "', revert to default config.\n";
+		LOG_INFO("Could not load '" << CONFIG_FILE_NAME << "', revert to default config.\n");
 		g_currentConf = &c_defaultConf;
 	}
 	else
@@ -478,75 +1211,137 @@ int main()
 		}
 		catch (json::parse_error& ex)
 		{
-			std::cerr << "parse error at byte " << ex.byte << ": " << ex.what() << std::endl;
-			std::cout << "Error while loading config file, revert to default config.\n";
+			LOG_WARN("parse error at byte " << ex.byte << ": " << ex.what() << "\n");
+			LOG_INFO("Error while loading config file, revert to default config.\n");
 			g_currentConf = &c_defaultConf;
 		}
 	}
 
 	confFile.close();
+	g_startupTiming.endPhase("config parse");
 
-	// setup midi callback
-	RtMidiIn *midiin = new RtMidiIn();
-	midiin->setCallback(&mycallback);
-	midiin->ignoreTypes(true, true, true);
-	std::cout << "Waiting for a MIDI input device...\n";
-
-	while (midiin->getPortCount() == 0)
-		Sleep(200);
+	std::string logLevelName = g_currentConf->value(JSTR_LOG_LEVEL, std::string("info"));
+	int logLevel = logLevelFromName(logLevelName);
+	if (logLevel >= 0)
+		g_logLevel = logLevel;
+	else
+		LOG_WARN("Unknown log level '" << logLevelName << "', using 'info'.\n");
 
-	g_portName = midiin->getPortName(0);
+	g_analyzeTiming = g_currentConf->value(JSTR_ANALYZE_TIMING, false);
+	if (g_analyzeTiming)
+		LOG_INFO("MIDI timing analysis enabled, the report will be printed on exit.\n");
 
-	std::cout << "Reading MIDI input from device \"" << g_portName << "\"...\n";
+	int metricsPort = g_currentConf->value(JSTR_METRICS_PORT, 0);
+	std::string metricsSocket = g_currentConf->value(JSTR_METRICS_SOCKET, std::string());
+	if (metricsPort > 0 or not metricsSocket.empty())
+		g_metricsEnabled = metricsStart(metricsPort, metricsSocket);
+	indexDevices();
+	g_startupTiming.endPhase("options");
 
-	if (g_currentConf->contains(JSTR_DEVICES))
+	// messages of every input are merged into this thread through the event queue
+	int queueSize = g_currentConf->value(JSTR_INPUT_QUEUE_SIZE, EVENT_QUEUE_DEFAULT_SIZE);
+	if (queueSize < 2)
 	{
-		json deviceArray = g_currentConf->at(JSTR_DEVICES);
-		for (int i = 0; i < deviceArray.size(); ++i)
-		{
-			json deviceData = deviceArray[i];
-			if (!deviceData.contains(JSTR_PORTNAME) or deviceData.at(JSTR_PORTNAME) == "" or deviceData.at(JSTR_PORTNAME) == g_portName)
-			{
-				device = deviceArray[i];
-				g_currentDev = &device;
-				std::cout << "Found device " << deviceData.at(JSTR_PORTNAME) << " in config!\n";
-				break;
-			}
-		}
+		LOG_WARN("Invalid " << JSTR_INPUT_QUEUE_SIZE << " " << queueSize << ", using " << EVENT_QUEUE_DEFAULT_SIZE << ".\n");
+		queueSize = EVENT_QUEUE_DEFAULT_SIZE;
 	}
+	std::string overflow = g_currentConf->value(JSTR_INPUT_QUEUE_OVERFLOW, std::string("drop_newest"));
+	e_overflowPolicy overflowPolicy = OVERFLOW_DROP_NEWEST;
+	if (overflow == "drop_oldest")
+		overflowPolicy = OVERFLOW_DROP_OLDEST;
+	else if (overflow == "coalesce_cc")
+		overflowPolicy = OVERFLOW_COALESCE_CC;
+	else if (overflow != "drop_newest")
+		LOG_WARN("Unknown " << JSTR_INPUT_QUEUE_OVERFLOW << " \"" << overflow << "\", using \"drop_newest\".\n");
+	g_eventQueue.init(queueSize, overflowPolicy);
+	g_eventSignal = CreateEvent(NULL, FALSE, FALSE, NULL);
 
-	if (g_currentDev == 0)
+	// plug and unplug are signaled by RtMidi, ESC is read from the console input
+	HANDLE portEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	HANDLE console = GetStdHandle(STD_INPUT_HANDLE);
+	DWORD consoleEvents;
+	if (console == INVALID_HANDLE_VALUE or not GetNumberOfConsoleInputEvents(console, &consoleEvents))
 	{
-		std::cout << "No corresponding device found in config. Control inputs will not be available.\n";
+		LOG_WARN("No console input, ESC will not quit.\n");
+		console = NULL;
 	}
 
-	std::cout << "\nTo quit, press ESC or unplug your MIDI controller.\n\n";
+	std::vector<RtMidi::Api> apis;
+	RtMidi::getCompiledApi(apis);
+	if (std::find(apis.begin(), apis.end(), RtMidi::LINUX_ALSA_SHARED) != apis.end())
+		g_inputApi = RtMidi::LINUX_ALSA_SHARED;
+
+	// only used to list the ports and be notified of their changes, each port is opened by its own instance
+	RtMidiIn *midiin = new RtMidiIn();
+	midiin->setPortListCallback(&onPortListChange, portEvent);
+	g_startupTiming.endPhase("rtmidi init");
 
-	midiin->openPort(0);
+	// a virtual port is an input of its own, there is no need to wait for a controller
+	std::string virtualPortName = g_currentConf->value(JSTR_VIRTUAL_PORT, std::string());
+	if (not virtualPortName.empty())
+	{
+		s_input* input = createInput(virtualPortName);
+		input->isVirtual = true;
+		if (connectInput(input, 0))
+			g_inputs.push_back(input);
+		else
+			delete input;
+	}
 
-	while (midiin->getPortCount() > 0)
+	bool quit = false;
+	if (g_inputs.empty())
 	{
-		Sleep(5);
+		LOG_INFO("Waiting for a MIDI input device...\n");
+		while (midiin->getPortCount() == 0 and not quit)
+			quit = waitForEvents(portEvent, console);
+	}
+
+	if (quit)
+	{
+		delete midiin;
+		CloseHandle(portEvent);
+		CloseHandle(g_eventSignal);
+		metricsStop();
+		return 0;
+	}
+
+	g_startupTiming.endPhase("device wait");
+
+	unsigned long long generation = midiin->getPortListGeneration();
+	updateInputs(midiin);
+	g_startupTiming.endPhase("port open");
 
-		DWORD pid1, pid2;
-		HWND handle=GetConsoleWindow();
-		while (true)
+	g_startupTiming.print();
+	if (g_metricsEnabled)
+		metricsSetStartup(g_startupTiming.phases, g_startupTiming.totalUs());
+
+	LOG_INFO("\nTo quit, press ESC. MIDI controllers can be unplugged and plugged again at any time.\n\n");
+
+	while (not waitForEvents(portEvent, console))
+	{
+		unsigned long long current = midiin->getPortListGeneration();
+		if (current != generation)
 		{
-			HWND parent = GetParent(handle);
-			if (parent != NULL && parent != GetDesktopWindow())
-				handle = GetParent(handle);
-			else
-				break;
+			generation = current;
+			updateInputs(midiin);
 		}
+	}
 
-		GetWindowThreadProcessId(handle, &pid1);
-		GetWindowThreadProcessId(GetForegroundWindow(), &pid2);
-		if ((GetAsyncKeyState(VK_ESCAPE) & 0x8000) && pid1==pid2)
-			break;
+	for (s_input* input : g_inputs)
+	{
+		if (input->midiin != 0)
+			disconnectInput(input);
+		delete input;
 	}
+	g_inputs.clear();
+
+	if (g_analyzeTiming)
+		timingPrintReport();
 
-	midiin->closePort();
+	metricsStop();
 
 	delete midiin;
+	CloseHandle(portEvent);
+	CloseHandle(g_eventSignal);
 	return 0;
 }
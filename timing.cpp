@@ -0,0 +1,284 @@
+// timing.cpp : inbound MIDI timing and jitter analysis.
+//
+
+#include "timing.h"
+#include "logging.h"
+
+#include <cmath>
+#include <cstdio>
+
+std::map<std::string, s_portTiming> g_portTimings;
+s_startupTiming g_startupTiming;
+
+static const char* midiTypeName(unsigned char status)
+{
+	switch (status & 0xF0)
+	{
+	case 0x80: return "note off";
+	case 0x90: return "note on";
+	case 0xA0: return "aftertouch";
+	case 0xB0: return "cc";
+	case 0xC0: return "program";
+	case 0xD0: return "pressure";
+	case 0xE0: return "pitch bend";
+	}
+
+	if (status == 0xF0)
+		return "sysex";
+	if (status >= 0xF8)
+		return "realtime";
+	return "system";
+}
+
+static std::string formatUs(double us)
+{
+	char buf[32];
+	if (us < 1000.0)
+		snprintf(buf, sizeof(buf), "%.0fus", us);
+	else if (us < 1000000.0)
+		snprintf(buf, sizeof(buf), "%.3fms", us / 1000.0);
+	else
+		snprintf(buf, sizeof(buf), "%.3fs", us / 1000000.0);
+	return buf;
+}
+
+void s_histogram::add(double us)
+{
+	if (us < 0.0)
+		us = 0.0;
+
+	if (count == 0 or us < min)
+		min = us;
+	if (count == 0 or us > max)
+		max = us;
+
+	++count;
+	sum += us;
+	sumSq += us * us;
+
+	int bucket = 0;
+	while (bucket < TIMING_LOG2_BUCKETS - 1 and us >= (double)(1ull << bucket))
+		++bucket;
+	++buckets[bucket];
+}
+
+// Returns the upper bound of the bucket holding the p-th percentile (p in [0,1]).
+double s_histogram::percentile(double p) const
+{
+	if (count == 0)
+		return 0.0;
+
+	unsigned long long target = (unsigned long long)std::ceil(p * count);
+	unsigned long long seen = 0;
+	for (int i = 0; i < TIMING_LOG2_BUCKETS; ++i)
+	{
+		seen += buckets[i];
+		if (seen >= target)
+			return std::fmin((double)(1ull << i), max);
+	}
+
+	return max;
+}
+
+void s_histogram::print(const char* name) const
+{
+	if (count == 0)
+	{
+		LOG_INFO("  " << name << ": no data\n");
+		return;
+	}
+
+	double mean = sum / count;
+	double variance = sumSq / count - mean * mean;
+	double stddev = variance > 0.0 ? std::sqrt(variance) : 0.0;
+
+	LOG_INFO("  " << name << ": n=" << count
+		<< " min=" << formatUs(min)
+		<< " p50<=" << formatUs(percentile(0.5))
+		<< " p99<=" << formatUs(percentile(0.99))
+		<< " max=" << formatUs(max)
+		<< " mean=" << formatUs(mean)
+		<< " stddev=" << formatUs(stddev) << "\n");
+}
+
+void timingRecord(const std::string& portName, unsigned char status, double deltatime, unsigned long long timeStamp, t_timePoint arrival, t_timePoint handled)
+{
+	s_portTiming& t = g_portTimings[portName];
+
+	t.handling.add(std::chrono::duration<double, std::micro>(handled - arrival).count());
+	double arrivalNs = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(arrival.time_since_epoch()).count();
+	t.deliveryLatency.add((arrivalNs - (double)timeStamp) / 1000.0);
+
+	// RtMidi reports a zero delta for the very first message of a port, there is nothing to measure yet.
+	if (not t.hasLastArrival)
+	{
+		t.hasLastArrival = true;
+		t.lastArrival = arrival;
+		return;
+	}
+
+	double driverUs = deltatime * 1000000.0;
+	double hostUs = std::chrono::duration<double, std::micro>(arrival - t.lastArrival).count();
+	t.lastArrival = arrival;
+
+	t.driverDelta.add(driverUs);
+	t.hostDelta.add(hostUs);
+	t.deliveryJitter.add(std::fabs(hostUs - driverUs));
+	t.driverDeltaByType[midiTypeName(status)].add(driverUs);
+
+	if (driverUs < 1.0)
+	{
+		++t.zeroDeltas;
+	}
+	else
+	{
+		int fine = (int)(driverUs / TIMING_FINE_BUCKET_US);
+		if (fine < TIMING_FINE_BUCKETS)
+			++t.fineBuckets[fine];
+	}
+
+	if (driverUs < TIMING_BURST_GAP_US)
+	{
+		// a burst starts with the previous message
+		if (t.currentBurst == 0)
+		{
+			t.currentBurst = 1;
+			++t.burstCount;
+			++t.burstMessages;
+		}
+		++t.currentBurst;
+		++t.burstMessages;
+		if (t.currentBurst > t.longestBurst)
+			t.longestBurst = t.currentBurst;
+	}
+	else
+	{
+		t.currentBurst = 0;
+	}
+}
+
+// USB-MIDI devices are polled at a fixed interval (1ms at full speed) and drivers may timestamp
+// at a coarse resolution, so the short non-zero gaps cluster on multiples of that interval.
+// Returns the largest candidate interval matching at least 90% of them, or 0 if none does.
+static double arrivalGranularityUs(const s_portTiming& t, double* matchRatio)
+{
+	static const double candidates[] = { 8000.0, 4000.0, 2000.0, 1000.0, 500.0 };
+
+	unsigned long long total = 0;
+	for (int i = 0; i < TIMING_FINE_BUCKETS; ++i)
+		total += t.fineBuckets[i];
+
+	*matchRatio = 0.0;
+	if (total < 16)
+		return 0.0;
+
+	for (double period : candidates)
+	{
+		unsigned long long matching = 0;
+		for (int i = 0; i < TIMING_FINE_BUCKETS; ++i)
+		{
+			double center = (i + 0.5) * TIMING_FINE_BUCKET_US;
+			double distance = std::fmod(center, period);
+			if (distance > period / 2)
+				distance = period - distance;
+			if (distance <= TIMING_FINE_BUCKET_US / 2.0)
+				matching += t.fineBuckets[i];
+		}
+
+		double ratio = (double)matching / total;
+		if (ratio >= 0.9)
+		{
+			*matchRatio = ratio;
+			return period;
+		}
+	}
+
+	return 0.0;
+}
+
+void timingPrintReport()
+{
+	if (g_portTimings.empty())
+	{
+		LOG_INFO("\nTiming report: no MIDI message received.\n");
+		return;
+	}
+
+	for (auto& it : g_portTimings)
+	{
+		const s_portTiming& t = it.second;
+		LOG_INFO("\nTiming report for \"" << it.first << "\":\n");
+		t.driverDelta.print("driver inter-arrival ");
+		t.hostDelta.print("host inter-arrival   ");
+		t.deliveryJitter.print("delivery jitter      ");
+		t.deliveryLatency.print("delivery latency     ");
+		t.handling.print("callback handling    ");
+
+		for (auto& type : t.driverDeltaByType)
+		{
+			std::string name = "  " + type.first;
+			name.resize(21, ' ');
+			type.second.print(name.c_str());
+		}
+
+		LOG_INFO("  bursts: " << t.burstCount << " (gaps < " << formatUs(TIMING_BURST_GAP_US) << ")");
+		if (t.burstCount > 0)
+		{
+			LOG_INFO(", longest " << t.longestBurst << " messages, mean "
+				<< (double)t.burstMessages / t.burstCount << " messages");
+		}
+		LOG_INFO("\n");
+
+		if (t.driverDelta.count > 0)
+		{
+			LOG_INFO("  same timestamp as previous message: "
+				<< 100.0 * t.zeroDeltas / t.driverDelta.count << "%\n");
+		}
+
+		double ratio;
+		double granularity = arrivalGranularityUs(t, &ratio);
+		if (granularity > 0.0)
+		{
+			LOG_INFO("  arrival granularity: " << formatUs(granularity)
+				<< " (" << 100.0 * ratio << "% of short gaps), likely USB polling or driver timestamp resolution\n");
+		}
+		else
+		{
+			LOG_INFO("  arrival granularity: none detected\n");
+		}
+
+		// Rough attribution of where the latency comes from.
+		double controller = t.driverDelta.percentile(0.99);
+		double driver = t.deliveryJitter.percentile(0.99);
+		double process = t.handling.percentile(0.99);
+		LOG_INFO("  p99: controller/USB inter-arrival " << formatUs(controller)
+			<< ", driver/scheduling delay " << formatUs(driver)
+			<< ", our processing " << formatUs(process) << "\n");
+	}
+}
+
+void s_startupTiming::begin()
+{
+	start = phaseStart = std::chrono::steady_clock::now();
+	phases.clear();
+}
+
+void s_startupTiming::endPhase(const char* name)
+{
+	t_timePoint now = std::chrono::steady_clock::now();
+	phases.push_back({ name, std::chrono::duration<double, std::micro>(now - phaseStart).count() });
+	phaseStart = now;
+}
+
+double s_startupTiming::totalUs() const
+{
+	return std::chrono::duration<double, std::micro>(phaseStart - start).count();
+}
+
+void s_startupTiming::print() const
+{
+	LOG_INFO("Startup:");
+	for (auto& phase : phases)
+		LOG_INFO(" " << phase.first << " " << formatUs(phase.second) << ",");
+	LOG_INFO(" ready to dispatch after " << formatUs(totalUs()) << "\n");
+}
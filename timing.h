@@ -0,0 +1,85 @@
+// timing.h : inbound MIDI timing and jitter analysis.
+// Enabled with the "analyze_timing" config option, the report is printed when the program quits.
+//
+
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+// log2 buckets in microseconds : [0,1us), [1,2us), [2,4us) ... up to ~33s
+#define TIMING_LOG2_BUCKETS		26
+// 125us buckets up to 16ms, used to find the arrival granularity (USB polling interval)
+#define TIMING_FINE_BUCKETS		128
+#define TIMING_FINE_BUCKET_US	125
+// messages closer than this to the previous one belong to the same burst
+#define TIMING_BURST_GAP_US		2000
+
+typedef std::chrono::steady_clock::time_point t_timePoint;
+
+struct s_histogram
+{
+	unsigned long long count = 0;
+	double sum = 0.0;
+	double sumSq = 0.0;
+	double min = 0.0;
+	double max = 0.0;
+	unsigned long long buckets[TIMING_LOG2_BUCKETS] = {};
+
+	void add(double us);
+	double percentile(double p) const;
+	void print(const char* name) const;
+};
+
+struct s_portTiming
+{
+	// time between two messages, as timestamped by the driver (deltatime given by RtMidi)
+	s_histogram driverDelta;
+	// time between two callbacks, as seen by this process
+	s_histogram hostDelta;
+	// |hostDelta - driverDelta| : how much the delivery of each message was delayed or hurried
+	s_histogram deliveryJitter;
+	// time spent handling each message in the callback
+	s_histogram handling;
+	// time from the driver timestamp to the callback, mapped onto steady_clock with a small offset
+	// and, on WinMM, a millisecond resolution (see RtMidiRawCallback)
+	s_histogram deliveryLatency;
+	std::map<std::string, s_histogram> driverDeltaByType;
+
+	unsigned long long fineBuckets[TIMING_FINE_BUCKETS] = {};
+	unsigned long long zeroDeltas = 0;
+
+	unsigned long long burstCount = 0;
+	unsigned long long burstMessages = 0;
+	unsigned long long longestBurst = 0;
+	unsigned long long currentBurst = 0;
+
+	bool hasLastArrival = false;
+	t_timePoint lastArrival;
+};
+
+// Records one message. Must always be called from the same thread (the main thread, which handles the messages).
+// timeStamp is the absolute message timestamp given by RtMidi, in ns.
+void timingRecord(const std::string& portName, unsigned char status, double deltatime, unsigned long long timeStamp, t_timePoint arrival, t_timePoint handled);
+
+// Prints the summary for every port. Call once the MIDI input is closed.
+void timingPrintReport();
+
+// Startup phase breakdown, timed with the monotonic clock from the start of main.
+struct s_startupTiming
+{
+	t_timePoint start;
+	t_timePoint phaseStart;
+	std::vector<std::pair<std::string, double>> phases;	// name, duration in us
+
+	void begin();
+	// Ends the current phase and starts the next one.
+	void endPhase(const char* name);
+	// Time since begin(), in us.
+	double totalUs() const;
+	void print() const;
+};
+
+extern s_startupTiming g_startupTiming;